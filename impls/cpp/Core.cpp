@@ -1,11 +1,21 @@
 #include "MAL.h"
 #include "Environment.h"
+#include "Image.h"
+#include "IntKernels.h"
+#include "Interpreter.h"
+#include "Profiler.h"
+#include "RuntimeStats.h"
 #include "StaticList.h"
+#include "ThreadPool.h"
+#include "Tracer.h"
 #include "Types.h"
 
+#include <algorithm>
 #include <chrono>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <time.h>
 
 #define CHECK_ARGS_IS(expected) \
     checkArgsIs(name.c_str(), expected, \
@@ -21,21 +31,36 @@
 
 static String printValues(malValueIter begin, malValueIter end,
                            const String& sep, bool readably);
+static String readFile(const String& filename);
 
-static StaticList<malBuiltIn*> handlers;
+//  not and load-file were defined in mal, before they were builtins, so they
+//  report the wrong number of arguments as functions defined in mal do.
+#define CHECK_PARAMS_IS(expected) \
+    checkParamsIs(expected, std::distance(argsBegin, argsEnd))
+
+static void checkParamsIs(int expected, int got)
+{
+    MAL_CHECK(got >= expected, "Not enough parameters");
+    MAL_CHECK(got <= expected, "Too many parameters");
+}
+
+// The builtins are shared by all interpreters, so the list holds them for as
+// long as the process runs, rather than any one environment.
+static StaticList<malValuePtr> handlers;
 
 #define ARG(type, name) type* name = VALUE_CAST(type, *argsBegin++)
 
 #define FUNCNAME(uniq) builtIn ## uniq
 #define HRECNAME(uniq) handler ## uniq
-#define BUILTIN_DEF(uniq, symbol) \
+#define BUILTIN_DEF(uniq, symbol, isPure) \
     static malBuiltIn::ApplyFunc FUNCNAME(uniq); \
-    static StaticList<malBuiltIn*>::Node HRECNAME(uniq) \
-        (handlers, new malBuiltIn(symbol, FUNCNAME(uniq))); \
+    static StaticList<malValuePtr>::Node HRECNAME(uniq) \
+        (handlers, new malBuiltIn(symbol, FUNCNAME(uniq), isPure)); \
     malValuePtr FUNCNAME(uniq)(const String& name, \
         malValueIter argsBegin, malValueIter argsEnd)
 
-#define BUILTIN(symbol)  BUILTIN_DEF(__LINE__, symbol)
+#define BUILTIN(symbol)       BUILTIN_DEF(__LINE__, symbol, false)
+#define PURE_BUILTIN(symbol)  BUILTIN_DEF(__LINE__, symbol, true)
 
 #define BUILTIN_ISA(symbol, type) \
     BUILTIN(symbol) { \
@@ -49,91 +74,446 @@ static StaticList<malBuiltIn*> handlers;
         return mal::boolean(*argsBegin == mal::constant()); \
     }
 
-#define BUILTIN_INTOP(op, checkDivByZero) \
-    BUILTIN(#op) { \
-        CHECK_ARGS_IS(2); \
-        ARG(malInteger, lhs); \
-        ARG(malInteger, rhs); \
-        if (checkDivByZero) { \
-            MAL_CHECK(rhs->value() != 0, "Division by zero"); \
+// Arithmetic folds its arguments from left to right in a native integer, so
+// only the result gets allocated. A single argument is combined with the
+// identity, as in (- x). checkedOp returns true if the result overflowed.
+#define BUILTIN_INTOP(op, minArgs, identity, checkedOp) \
+    PURE_BUILTIN(#op) { \
+        int argCount = CHECK_ARGS_AT_LEAST(minArgs); \
+        int64_t result = identity; \
+        if (argCount > 1) { \
+            ARG(malInteger, first); \
+            result = first->value(); \
         } \
-        return mal::integer(lhs->value() op rhs->value()); \
+        while (argsBegin != argsEnd) { \
+            ARG(malInteger, arg); \
+            MAL_CHECK(!checkedOp(result, arg->value(), &result), \
+                      "Integer overflow in " #op); \
+        } \
+        return mal::integer(result); \
     }
 
+// Comparisons are true if every adjacent pair of arguments is in order.
+#define BUILTIN_INTCMP(op) \
+    PURE_BUILTIN(#op) { \
+        CHECK_ARGS_AT_LEAST(1); \
+        ARG(malInteger, first); \
+        int64_t lhs = first->value(); \
+        bool result = true; \
+        while (argsBegin != argsEnd) { \
+            ARG(malInteger, rhs); \
+            result = result && (lhs op rhs->value()); \
+            lhs = rhs->value(); \
+        } \
+        return mal::boolean(result); \
+    }
+
+static bool checkedDivide(int64_t lhs, int64_t rhs, int64_t* result)
+{
+    MAL_CHECK(rhs != 0, "Division by zero");
+    if ((lhs == INT64_MIN) && (rhs == -1)) {
+        return true;
+    }
+    *result = lhs / rhs;
+    return false;
+}
+
+static bool checkedRemainder(int64_t lhs, int64_t rhs, int64_t* result)
+{
+    MAL_CHECK(rhs != 0, "Division by zero");
+    *result = (rhs == -1) ? 0 : lhs % rhs; // INT64_MIN % -1 traps
+    return false;
+}
+
 BUILTIN_ISA("atom?",        malAtom);
+BUILTIN_ISA("int-array?",   malIntArray);
 BUILTIN_ISA("keyword?",     malKeyword);
 BUILTIN_ISA("list?",        malList);
 BUILTIN_ISA("map?",         malHash);
 BUILTIN_ISA("number?",      malInteger);
-BUILTIN_ISA("sequential?",  malSequence);
 BUILTIN_ISA("string?",      malString);
 BUILTIN_ISA("symbol?",      malSymbol);
 BUILTIN_ISA("vector?",      malVector);
 
-BUILTIN_INTOP(+,            false);
-BUILTIN_INTOP(/,            true);
-BUILTIN_INTOP(*,            false);
-BUILTIN_INTOP(%,            true);
+BUILTIN_INTOP(+,            0, 0, __builtin_add_overflow);
+BUILTIN_INTOP(-,            1, 0, __builtin_sub_overflow);
+BUILTIN_INTOP(*,            0, 1, __builtin_mul_overflow);
+BUILTIN_INTOP(/,            1, 1, checkedDivide);
+
+// Unlike the other arithmetic builtins, % takes exactly two arguments.
+PURE_BUILTIN("%")
+{
+    CHECK_ARGS_IS(2);
+    ARG(malInteger, lhs);
+    ARG(malInteger, rhs);
+    int64_t result;
+    checkedRemainder(lhs->value(), rhs->value(), &result);
+    return mal::integer(result);
+}
+
+BUILTIN_INTCMP(<=);
+BUILTIN_INTCMP(>=);
+BUILTIN_INTCMP(<);
+BUILTIN_INTCMP(>);
 
 BUILTIN_IS("true?",         trueValue);
 BUILTIN_IS("false?",        falseValue);
 BUILTIN_IS("nil?",          nilValue);
 
-BUILTIN("-")
+// Calls a function repeatedly with the same number of arguments, reusing one
+// argument vector, and calling straight into its apply() rather than going
+// through APPLY each time.
+class Caller {
+public:
+    Caller(malValuePtr op, int argCount)
+    : m_handler(op ? DYNAMIC_CAST(malApplicable, op) : NULL)
+    , m_args(argCount)
+    {
+        MAL_CHECK(!op || m_handler,
+                  "\"%s\" is not applicable", op->print(true).c_str());
+    }
+
+    malValuePtr operator () () {
+        return m_handler->apply(m_args.begin(), m_args.end());
+    }
+
+    malValuePtr operator () (malValuePtr arg) {
+        m_args[0] = arg;
+        return m_handler->apply(m_args.begin(), m_args.end());
+    }
+
+    malValuePtr operator () (malValuePtr arg0, malValuePtr arg1) {
+        m_args[0] = arg0;
+        m_args[1] = arg1;
+        return m_handler->apply(m_args.begin(), m_args.end());
+    }
+
+private:
+    const malApplicable* m_handler;
+    malValueVec          m_args;
+};
+
+// Reduces the items of source with op, after passing each one through the
+// steps of a transducer.
+static malValuePtr transduce(const malTransducer::StepVec& steps,
+                             malValuePtr op, malValuePtr acc,
+                             malValuePtr source)
 {
-    int argCount = CHECK_ARGS_BETWEEN(1, 2);
-    ARG(malInteger, lhs);
-    if (argCount == 1) {
-        return mal::integer(- lhs->value());
+    std::vector<Caller>  callers;
+    std::vector<int64_t> counts;
+    for (auto it = steps.begin(); it != steps.end(); ++it) {
+        callers.push_back(Caller(it->op, 1));
+        counts.push_back(it->count);
+    }
+    Caller reducer(op, 2);
+
+    for (malIterator it(source); !it.atEnd(); it.next()) {
+        malValuePtr value = it.value();
+        bool isKept = true, isLast = false;
+        for (size_t i = 0; isKept && (i < steps.size()); i++) {
+            switch (steps[i].kind) {
+                case malTransducer::MAP:
+                    value = callers[i](value);
+                    break;
+                case malTransducer::FILTER:
+                    isKept = callers[i](value)->isTrue();
+                    break;
+                case malTransducer::REMOVE:
+                    isKept = !callers[i](value)->isTrue();
+                    break;
+                case malTransducer::KEEP:
+                    value = callers[i](value);
+                    isKept = (value != mal::nilValue());
+                    break;
+                case malTransducer::TAKE:
+                    if (counts[i] <= 0) {
+                        return acc;
+                    }
+                    isLast = isLast || (--counts[i] == 0);
+                    break;
+                case malTransducer::DROP:
+                    if (counts[i] > 0) {
+                        counts[i]--;
+                        isKept = false;
+                    }
+                    break;
+            }
+        }
+        if (isKept) {
+            acc = reducer(acc, value);
+        }
+        if (isLast) {
+            break;
+        }
     }
+    return acc;
+}
 
-    ARG(malInteger, rhs);
-    return mal::integer(lhs->value() - rhs->value());
+static malValuePtr transducerStep(malTransducer::Kind kind,
+                                  malValuePtr op, int64_t count)
+{
+    malTransducer::Step step = { kind, op, count };
+    return mal::transducer(malTransducer::StepVec(1, step));
 }
 
-BUILTIN("<=")
+// Generators for the lazy sequence builtins. Each keeps its position in its
+// source up to date as it goes, so that items it has passed can be freed.
+
+class FnGenerator : public malLazySeq::Generator {
+public:
+    FnGenerator(malValuePtr op) : m_op(op) { }
+
+    virtual malValuePtr generate() {
+        malValueVec args;
+        return APPLY(m_op, args.begin(), args.end());
+    }
+
+private:
+    const malValuePtr m_op;
+};
+
+class RangeGenerator : public malLazySeq::Generator {
+public:
+    RangeGenerator(int64_t start, int64_t end, int64_t step, bool isEndless)
+    : m_start(start), m_end(end), m_step(step), m_isEndless(isEndless) { }
+
+    virtual malValuePtr generate() {
+        if (!m_isEndless &&
+                ((m_step > 0) ? (m_start >= m_end) : (m_start <= m_end))) {
+            return mal::nilValue();
+        }
+        return mal::lazySeq(mal::integer(m_start), mal::lazySeq(
+            new RangeGenerator(m_start + m_step, m_end, m_step, m_isEndless)));
+    }
+
+private:
+    const int64_t m_start, m_end, m_step;
+    const bool    m_isEndless;
+};
+
+class MapGenerator : public malLazySeq::Generator {
+public:
+    MapGenerator(malValuePtr op, malValuePtr source)
+    : m_op(op), m_source(source) { }
+
+    virtual malValuePtr generate() {
+        malIterator it(m_source);
+        if (it.atEnd()) {
+            return mal::nilValue();
+        }
+        malValuePtr value = Caller(m_op, 1)(it.value());
+        it.next();
+        return mal::lazySeq(value,
+            mal::lazySeq(new MapGenerator(m_op, it.rest())));
+    }
+
+private:
+    const malValuePtr m_op;
+    const malValuePtr m_source;
+};
+
+// Generates the items for which pred is true, or false if it's a remove.
+class FilterGenerator : public malLazySeq::Generator {
+public:
+    FilterGenerator(malValuePtr pred, malValuePtr source, bool isRemove)
+    : m_pred(pred), m_source(source), m_isRemove(isRemove) { }
+
+    virtual malValuePtr generate() {
+        Caller pred(m_pred, 1);
+        for (malIterator it(m_source); !it.atEnd(); ) {
+            malValuePtr value = it.value();
+            bool isMatch = pred(value)->isTrue() != m_isRemove;
+            it.next();
+            m_source = it.rest();
+            if (isMatch) {
+                return mal::lazySeq(value, mal::lazySeq(
+                    new FilterGenerator(m_pred, m_source, m_isRemove)));
+            }
+        }
+        return mal::nilValue();
+    }
+
+private:
+    const malValuePtr m_pred;
+    malValuePtr       m_source;
+    const bool        m_isRemove;
+};
+
+// Generates the non-nil results of op applied to each item.
+class KeepGenerator : public malLazySeq::Generator {
+public:
+    KeepGenerator(malValuePtr op, malValuePtr source)
+    : m_op(op), m_source(source) { }
+
+    virtual malValuePtr generate() {
+        Caller op(m_op, 1);
+        for (malIterator it(m_source); !it.atEnd(); ) {
+            malValuePtr value = op(it.value());
+            it.next();
+            m_source = it.rest();
+            if (value != mal::nilValue()) {
+                return mal::lazySeq(value,
+                    mal::lazySeq(new KeepGenerator(m_op, m_source)));
+            }
+        }
+        return mal::nilValue();
+    }
+
+private:
+    const malValuePtr m_op;
+    malValuePtr       m_source;
+};
+
+class TakeGenerator : public malLazySeq::Generator {
+public:
+    TakeGenerator(int64_t count, malValuePtr source)
+    : m_count(count), m_source(source) { }
+
+    virtual malValuePtr generate() {
+        malIterator it(m_source);
+        if ((m_count <= 0) || it.atEnd()) {
+            return mal::nilValue();
+        }
+        malValuePtr value = it.value();
+        it.next();
+        return mal::lazySeq(value,
+            mal::lazySeq(new TakeGenerator(m_count - 1, it.rest())));
+    }
+
+private:
+    const int64_t     m_count;
+    const malValuePtr m_source;
+};
+
+class DropGenerator : public malLazySeq::Generator {
+public:
+    DropGenerator(int64_t count, malValuePtr source)
+    : m_count(count), m_source(source) { }
+
+    virtual malValuePtr generate() {
+        malIterator it(m_source);
+        for ( ; (m_count > 0) && !it.atEnd(); m_count--) {
+            it.next();
+            m_source = it.rest();
+        }
+        return m_source;
+    }
+
+private:
+    int64_t     m_count;
+    malValuePtr m_source;
+};
+
+class ConcatGenerator : public malLazySeq::Generator {
+public:
+    // Generates the items of current, then those of parts from index on.
+    ConcatGenerator(malValuePtr current, malValuePtr parts, int index)
+    : m_current(current), m_parts(parts), m_index(index) { }
+
+    virtual malValuePtr generate() {
+        const malSequence* parts = STATIC_CAST(malSequence, m_parts);
+        for ( ; ; ) {
+            malIterator it(m_current);
+            if (!it.atEnd()) {
+                malValuePtr value = it.value();
+                it.next();
+                return mal::lazySeq(value, mal::lazySeq(
+                    new ConcatGenerator(it.rest(), m_parts, m_index)));
+            }
+            if (m_index == parts->count()) {
+                return mal::nilValue();
+            }
+            m_current = parts->item(m_index++);
+        }
+    }
+
+private:
+    malValuePtr       m_current;
+    const malValuePtr m_parts;
+    int               m_index;
+};
+
+PURE_BUILTIN("=")
 {
-    CHECK_ARGS_IS(2);
-    ARG(malInteger, lhs);
-    ARG(malInteger, rhs);
+    CHECK_ARGS_AT_LEAST(1);
+    const malValue* lhs = (*argsBegin++).ptr();
+    for ( ; argsBegin != argsEnd; ++argsBegin) {
+        if (!lhs->isEqualTo((*argsBegin).ptr())) {
+            return mal::falseValue();
+        }
+    }
+    return mal::trueValue();
+}
 
-    return mal::boolean(lhs->value() <= rhs->value());
+static void checkSameCount(const String& name,
+                           const malIntArray* lhs, const malIntArray* rhs)
+{
+    MAL_CHECK(lhs->count() == rhs->count(),
+              "\"%s\" expects int-arrays of the same length, got %d and %d",
+              name.c_str(), lhs->count(), rhs->count());
 }
 
-BUILTIN(">=")
+BUILTIN("adot")
 {
     CHECK_ARGS_IS(2);
-    ARG(malInteger, lhs);
-    ARG(malInteger, rhs);
-
-    return mal::boolean(lhs->value() >= rhs->value());
+    ARG(malIntArray, lhs);
+    ARG(malIntArray, rhs);
+    checkSameCount(name, lhs, rhs);
+
+    int64_t result;
+    MAL_CHECK(intDot(lhs->items().data(), rhs->items().data(), lhs->count(),
+                     &result),
+              "Integer overflow in adot");
+    return mal::integer(result);
 }
 
-BUILTIN("<")
+BUILTIN("aget")
 {
     CHECK_ARGS_IS(2);
-    ARG(malInteger, lhs);
-    ARG(malInteger, rhs);
+    ARG(malIntArray, array);
+    ARG(malInteger,  index);
+
+    int64_t i = index->value();
+    MAL_CHECK(i >= 0 && i < array->count(), "Index out of range");
 
-    return mal::boolean(lhs->value() < rhs->value());
+    return mal::integer(array->items()[i]);
 }
 
-BUILTIN(">")
+BUILTIN("amap+")
 {
     CHECK_ARGS_IS(2);
-    ARG(malInteger, lhs);
-    ARG(malInteger, rhs);
+    ARG(malIntArray, lhs);
+    ARG(malIntArray, rhs);
+    checkSameCount(name, lhs, rhs);
+
+    malIntArray::Vec* items = new malIntArray::Vec(lhs->count());
+    malValuePtr result = mal::intArray(items);
+    MAL_CHECK(intAdd(lhs->items().data(), rhs->items().data(), lhs->count(),
+                     items->data()),
+              "Integer overflow in amap+");
+    return result;
+}
+
+BUILTIN("amax")
+{
+    CHECK_ARGS_IS(1);
+    ARG(malIntArray, array);
+    MAL_CHECK(array->count() > 0, "amax of an empty int-array");
 
-    return mal::boolean(lhs->value() > rhs->value());
+    int64_t min, max;
+    intMinMax(array->items().data(), array->count(), &min, &max);
+    return mal::integer(max);
 }
 
-BUILTIN("=")
+BUILTIN("amin")
 {
-    CHECK_ARGS_IS(2);
-    const malValue* lhs = (*argsBegin++).ptr();
-    const malValue* rhs = (*argsBegin++).ptr();
+    CHECK_ARGS_IS(1);
+    ARG(malIntArray, array);
+    MAL_CHECK(array->count() > 0, "amin of an empty int-array");
 
-    return mal::boolean(lhs->isEqualTo(rhs));
+    int64_t min, max;
+    intMinMax(array->items().data(), array->count(), &min, &max);
+    return mal::integer(min);
 }
 
 BUILTIN("apply")
@@ -145,14 +525,38 @@ BUILTIN("apply")
     malValueVec args(argsBegin, argsEnd-1);
 
     // Then append the argument as a list.
-    const malSequence* lastArg = VALUE_CAST(malSequence, *(argsEnd-1));
-    for (int i = 0; i < lastArg->count(); i++) {
-        args.push_back(lastArg->item(i));
+    for (malIterator it(*(argsEnd-1)); !it.atEnd(); it.next()) {
+        args.push_back(it.value());
     }
 
     return APPLY(op, args.begin(), args.end());
 }
 
+BUILTIN("aset-copy")
+{
+    CHECK_ARGS_IS(3);
+    ARG(malIntArray, array);
+    ARG(malInteger,  index);
+    ARG(malInteger,  value);
+
+    int64_t i = index->value();
+    MAL_CHECK(i >= 0 && i < array->count(), "Index out of range");
+
+    malIntArray::Vec* items = new malIntArray::Vec(array->items());
+    (*items)[i] = value->value();
+    return mal::intArray(items);
+}
+
+BUILTIN("asort")
+{
+    CHECK_ARGS_IS(1);
+    ARG(malIntArray, array);
+
+    malIntArray::Vec* items = new malIntArray::Vec(array->items());
+    std::sort(items->begin(), items->end());
+    return mal::intArray(items);
+}
+
 BUILTIN("assoc")
 {
     CHECK_ARGS_AT_LEAST(1);
@@ -161,6 +565,17 @@ BUILTIN("assoc")
     return hash->assoc(argsBegin, argsEnd);
 }
 
+BUILTIN("asum")
+{
+    CHECK_ARGS_IS(1);
+    ARG(malIntArray, array);
+
+    int64_t result;
+    MAL_CHECK(intSum(array->items().data(), array->count(), &result),
+              "Integer overflow in asum");
+    return mal::integer(result);
+}
+
 BUILTIN("atom")
 {
     CHECK_ARGS_IS(1);
@@ -168,8 +583,125 @@ BUILTIN("atom")
     return mal::atom(*argsBegin);
 }
 
+static int64_t monotonicNs()
+{
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(
+        steady_clock::now().time_since_epoch()).count();
+}
+
+//  Calls a function of no arguments repeatedly for about ms milliseconds
+//  (1000 by default). The first tenth of the time is a warmup, which also
+//  decides how many calls to time at once, so that fast functions aren't
+//  swamped by the cost of reading the clock. Returns the per call times of
+//  the fastest, median and 99th percentile of those batches, and the number
+//  of objects allocated per call.
+BUILTIN("bench")
+{
+    int argCount = CHECK_ARGS_BETWEEN(1, 2);
+    Caller thunk(*argsBegin++, 0);
+    int64_t budgetNs = 1000000000;
+    if (argCount == 2) {
+        ARG(malInteger, ms);
+        MAL_CHECK(ms->value() > 0, "bench time must be positive");
+        MAL_CHECK(ms->value() < INT64_MAX / 1000000, "bench time is too long");
+        budgetNs = ms->value() * 1000000;
+    }
+
+    const int64_t start = monotonicNs();
+    int64_t warmupCalls = 0, now;
+    do {
+        thunk();
+        warmupCalls++;
+        now = monotonicNs();
+    } while (now - start < budgetNs / 10);
+
+    // Aim for at least 100 batches, of no more than a millisecond each.
+    const int64_t end = start + budgetNs;
+    const int64_t perCallNs = std::max<int64_t>(1, (now - start) / warmupCalls);
+    const int64_t batchNs = std::min<int64_t>(1000000, (end - now) / 100);
+    const int64_t batch = std::max<int64_t>(1, batchNs / perCallNs);
+
+    std::vector<int64_t> samples;
+    const int64_t allocations = RefCounted::allocations();
+    int64_t totalNs = 0;
+    do {
+        const int64_t batchStart = monotonicNs();
+        for (int64_t i = 0; i < batch; i++) {
+            thunk();
+        }
+        now = monotonicNs();
+        samples.push_back((now - batchStart) / batch);
+        totalNs += now - batchStart;
+    } while (now < end);
+
+    const int64_t calls = batch * samples.size();
+    const int64_t allocs = RefCounted::allocations() - allocations;
+    std::sort(samples.begin(), samples.end());
+    const size_t p99 = (samples.size() * 99 + 99) / 100 - 1;
+    malValueVec stats = {
+        mal::keyword(":calls"),     mal::integer(calls),
+        mal::keyword(":samples"),   mal::integer(samples.size()),
+        mal::keyword(":min-ns"),    mal::integer(samples.front()),
+        mal::keyword(":median-ns"), mal::integer(samples[samples.size() / 2]),
+        mal::keyword(":p99-ns"),    mal::integer(samples[p99]),
+        mal::keyword(":mean-ns"),   mal::integer(totalNs / calls),
+        mal::keyword(":allocs"),    mal::integer((allocs + calls / 2) / calls),
+    };
+    return mal::hash(stats.begin(), stats.end(), true);
+}
+
+BUILTIN("comp")
+{
+    CHECK_ARGS_AT_LEAST(1);
+
+    malTransducer::StepVec steps;
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        const malTransducer* xform = DYNAMIC_CAST(malTransducer, *it);
+        if (!xform) {
+            return mal::composition(argsBegin, argsEnd);
+        }
+        steps.insert(steps.end(), xform->steps().begin(), xform->steps().end());
+    }
+    return mal::transducer(steps);
+}
+
+//  Sets an atom to newval if its value is still equal to oldval, returning
+//  whether it did.
+BUILTIN("compare-and-set!")
+{
+    CHECK_ARGS_IS(3);
+    ARG(malAtom, atom);
+    malValuePtr expected = *argsBegin++;
+    malValuePtr value = *argsBegin++;
+
+    for (;;) {
+        malValuePtr current = atom->deref();
+        if (!current->isEqualTo(expected.ptr())) {
+            return mal::falseValue();
+        }
+        if (atom->compareAndSet(current, value)) {
+            return mal::trueValue();
+        }
+        RuntimeStats::addAtomRetries(1);
+    }
+}
+
 BUILTIN("concat")
 {
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        if (DYNAMIC_CAST(malLazySeq, *it)) {
+            // Any lazy argument makes the whole result lazy.
+            for (auto part = argsBegin; part != argsEnd; ++part) {
+                if (!DYNAMIC_CAST(malLazySeq, *part)) {
+                    VALUE_CAST(malSequence, *part);
+                }
+            }
+            return mal::lazySeq(new ConcatGenerator(mal::nilValue(),
+                mal::list(argsBegin, argsEnd), 0));
+        }
+    }
+
     int count = 0;
     for (auto it = argsBegin; it != argsEnd; ++it) {
         const malSequence* seq = VALUE_CAST(malSequence, *it);
@@ -190,6 +722,14 @@ BUILTIN("concat")
 BUILTIN("conj")
 {
     CHECK_ARGS_AT_LEAST(1);
+    // Lazy sequences stay lazy, with the items added in front, as lists.
+    if (DYNAMIC_CAST(malLazySeq, *argsBegin)) {
+        malValuePtr seq = *argsBegin++;
+        for (; argsBegin != argsEnd; ++argsBegin) {
+            seq = mal::lazySeq(*argsBegin, seq);
+        }
+        return seq;
+    }
     ARG(malSequence, seq);
 
     return seq->conj(argsBegin, argsEnd);
@@ -199,6 +739,9 @@ BUILTIN("cons")
 {
     CHECK_ARGS_IS(2);
     malValuePtr first = *argsBegin++;
+    if (DYNAMIC_CAST(malLazySeq, *argsBegin)) {
+        return mal::lazySeq(first, *argsBegin);
+    }
     ARG(malSequence, rest);
 
     malValueVec* items = new malValueVec(1 + rest->count());
@@ -224,14 +767,48 @@ BUILTIN("count")
     if (*argsBegin == mal::nilValue()) {
         return mal::integer(0);
     }
+    if (DYNAMIC_CAST(malLazySeq, *argsBegin)) {
+        int64_t count = 0;
+        for (malIterator it(*argsBegin); !it.atEnd(); it.next()) {
+            count++;
+        }
+        return mal::integer(count);
+    }
+    if (const malIntArray* array = DYNAMIC_CAST(malIntArray, *argsBegin)) {
+        return mal::integer(array->count());
+    }
 
     ARG(malSequence, seq);
     return mal::integer(seq->count());
 }
 
+BUILTIN("deliver")
+{
+    CHECK_ARGS_IS(2);
+    ARG(malFuture, promise);
+    MAL_CHECK(promise->isPromise(), "Only promises can be delivered");
+
+    return promise->deliver(*argsBegin) ? malValuePtr(promise)
+                                        : mal::nilValue();
+}
+
+//  Futures and promises may be given a timeout in milliseconds, and a value
+//  to return if it passes first.
 BUILTIN("deref")
 {
-    CHECK_ARGS_IS(1);
+    int argCount = CHECK_ARGS_BETWEEN(1, 3);
+    if (const malFuture* future = DYNAMIC_CAST(malFuture, *argsBegin)) {
+        MAL_CHECK(argCount != 2, "deref takes a timeout and a timeout value");
+        argsBegin++;
+        int64_t timeoutNs = -1;
+        if (argCount == 3) {
+            ARG(malInteger, timeoutMs);
+            timeoutNs = std::max<int64_t>(0, timeoutMs->value()) * 1000000;
+        }
+        malValuePtr value = future->deref(timeoutNs);
+        return value ? value : *argsBegin;
+    }
+    MAL_CHECK(argCount == 1, "Only futures and promises take a timeout");
     ARG(malAtom, atom);
 
     return atom->deref();
@@ -245,14 +822,44 @@ BUILTIN("dissoc")
     return hash->dissoc(argsBegin, argsEnd);
 }
 
+BUILTIN("drop")
+{
+    int argCount = CHECK_ARGS_BETWEEN(1, 2);
+    ARG(malInteger, count);
+    if (argCount == 1) {
+        return transducerStep(malTransducer::DROP, NULL, count->value());
+    }
+
+    malValuePtr source = *argsBegin;
+    malIterator check(source); // throws if it isn't a sequence
+
+    return mal::lazySeq(new DropGenerator(count->value(), source));
+}
+
 BUILTIN("empty?")
 {
     CHECK_ARGS_IS(1);
+    if (const malLazySeq* lazy = DYNAMIC_CAST(malLazySeq, *argsBegin)) {
+        return mal::boolean(lazy->isEmpty());
+    }
     ARG(malSequence, seq);
 
     return mal::boolean(seq->isEmpty());
 }
 
+BUILTIN("every?")
+{
+    CHECK_ARGS_IS(2);
+    Caller pred(*argsBegin++, 1);
+
+    for (malIterator it(*argsBegin); !it.atEnd(); it.next()) {
+        if (!pred(it.value())->isTrue()) {
+            return mal::falseValue();
+        }
+    }
+    return mal::trueValue();
+}
+
 BUILTIN("eval")
 {
     CHECK_ARGS_IS(1);
@@ -265,10 +872,33 @@ BUILTIN("first")
     if (*argsBegin == mal::nilValue()) {
         return mal::nilValue();
     }
+    if (const malLazySeq* lazy = DYNAMIC_CAST(malLazySeq, *argsBegin)) {
+        return lazy->first();
+    }
     ARG(malSequence, seq);
     return seq->first();
 }
 
+BUILTIN("filter")
+{
+    int argCount = CHECK_ARGS_BETWEEN(1, 2);
+    malValuePtr pred = *argsBegin++; // this gets checked in APPLY
+    if (argCount == 1) {
+        return transducerStep(malTransducer::FILTER, pred, 0);
+    }
+
+    malValuePtr source = *argsBegin;
+    malIterator check(source); // throws if it isn't a sequence
+
+    return mal::lazySeq(new FilterGenerator(pred, source, false));
+}
+
+BUILTIN("folded-count")
+{
+    CHECK_ARGS_IS(0);
+    return mal::integer(malList::foldedCount());
+}
+
 BUILTIN("fn?")
 {
     CHECK_ARGS_IS(1);
@@ -282,6 +912,14 @@ BUILTIN("fn?")
     return mal::boolean(DYNAMIC_CAST(malBuiltIn, arg));
 }
 
+//  Calls f with no arguments on the thread pool, returning a future of its
+//  result.
+BUILTIN("future-call")
+{
+    CHECK_ARGS_IS(1);
+    return mal::future(*argsBegin); // this gets checked in APPLY
+}
+
 BUILTIN("get")
 {
     CHECK_ARGS_IS(2);
@@ -297,6 +935,41 @@ BUILTIN("hash-map")
     return mal::hash(argsBegin, argsEnd, true);
 }
 
+BUILTIN("int-array")
+{
+    CHECK_ARGS_IS(1);
+    malValuePtr arg = *argsBegin;
+
+    // Either the length of a zero filled array, or a sequence of integers.
+    if (const malInteger* length = DYNAMIC_CAST(malInteger, arg)) {
+        MAL_CHECK(length->value() >= 0, "int-array length must not be negative");
+        return mal::intArray(new malIntArray::Vec(length->value()));
+    }
+
+    malIntArray::Vec* items = new malIntArray::Vec;
+    malValuePtr result = mal::intArray(items);
+    if (const malSequence* seq = DYNAMIC_CAST(malSequence, arg)) {
+        items->reserve(seq->count());
+    }
+    for (malIterator it(arg); !it.atEnd(); it.next()) {
+        items->push_back(VALUE_CAST(malInteger, it.value())->value());
+    }
+    return result;
+}
+
+BUILTIN("keep")
+{
+    int argCount = CHECK_ARGS_BETWEEN(1, 2);
+    malValuePtr op = *argsBegin++; // this gets checked in APPLY
+    if (argCount == 1) {
+        return transducerStep(malTransducer::KEEP, op, 0);
+    }
+    malValuePtr source = *argsBegin;
+    malIterator check(source); // throws if it isn't a sequence
+
+    return mal::lazySeq(new KeepGenerator(op, source));
+}
+
 BUILTIN("keys")
 {
     CHECK_ARGS_IS(1);
@@ -315,6 +988,14 @@ BUILTIN("keyword")
     MAL_FAIL("keyword expects a keyword or string");
 }
 
+BUILTIN("lazy-seq")
+{
+    CHECK_ARGS_IS(1);
+    malValuePtr op = *argsBegin++; // this gets checked in APPLY
+
+    return mal::lazySeq(new FnGenerator(op));
+}
+
 BUILTIN("list")
 {
     return mal::list(argsBegin, argsEnd);
@@ -331,8 +1012,14 @@ BUILTIN("macro?")
 
 BUILTIN("map")
 {
-    CHECK_ARGS_IS(2);
+    int argCount = CHECK_ARGS_BETWEEN(1, 2);
     malValuePtr op = *argsBegin++; // this gets checked in APPLY
+    if (argCount == 1) {
+        return transducerStep(malTransducer::MAP, op, 0);
+    }
+    if (DYNAMIC_CAST(malLazySeq, *argsBegin)) {
+        return mal::lazySeq(new MapGenerator(op, *argsBegin));
+    }
     ARG(malSequence, source);
 
     const int length = source->count();
@@ -345,6 +1032,47 @@ BUILTIN("map")
     return  mal::list(items);
 }
 
+BUILTIN("memo-stats")
+{
+    CHECK_ARGS_IS(1);
+    ARG(malMemoized, memo);
+
+    malValuePtr capacity = memo->capacity() > 0
+                         ? mal::integer(memo->capacity()) : mal::nilValue();
+    malValueVec stats = {
+        mal::keyword(":hits"),      mal::integer(memo->hits()),
+        mal::keyword(":misses"),    mal::integer(memo->misses()),
+        mal::keyword(":size"),      mal::integer(memo->size()),
+        mal::keyword(":capacity"),  capacity,
+    };
+    return mal::hash(stats.begin(), stats.end(), true);
+}
+
+BUILTIN("memoize")
+{
+    int argCount = CHECK_ARGS_BETWEEN(1, 2);
+    malValuePtr op = *argsBegin++; // this gets checked in APPLY
+
+    int64_t capacity = 0;
+    if (argCount == 2) {
+        ARG(malInteger, capacityArg);
+        capacity = capacityArg->value();
+        MAL_CHECK(capacity > 0, "memoize capacity must be positive");
+    }
+    return mal::memoized(op, capacity);
+}
+
+//  Evaluates the forms in a file in the interpreter's root environment.
+BUILTIN("load-file")
+{
+    CHECK_PARAMS_IS(1);
+    ARG(malString, filename);
+    Tracer::Span span("eval", "load-file", filename->value());
+
+    String source = readFile(filename->value());
+    return EVAL(readStr("(do " + source + "\nnil)"), NULL);
+}
+
 BUILTIN("meta")
 {
     CHECK_ARGS_IS(1);
@@ -353,9 +1081,27 @@ BUILTIN("meta")
     return obj->meta();
 }
 
+PURE_BUILTIN("not")
+{
+    CHECK_PARAMS_IS(1);
+    return mal::boolean(!(*argsBegin)->isTrue());
+}
+
 BUILTIN("nth")
 {
     CHECK_ARGS_IS(2);
+    if (DYNAMIC_CAST(malLazySeq, *argsBegin)) {
+        malIterator it(*argsBegin++);
+        ARG(malInteger, index);
+
+        MAL_CHECK(index->value() >= 0, "Index out of range");
+        for (int64_t i = index->value(); i > 0 && !it.atEnd(); i--) {
+            it.next();
+        }
+        MAL_CHECK(!it.atEnd(), "Index out of range");
+
+        return it.value();
+    }
     ARG(malSequence, seq);
     ARG(malInteger,  index);
 
@@ -365,6 +1111,104 @@ BUILTIN("nth")
     return seq->item(i);
 }
 
+// The items of a sequence, lazy or not, for the parallel builtins to split.
+static malValueVec sequenceItems(malValuePtr sequence)
+{
+    malValueVec items;
+    for (malIterator it(sequence); !it.atEnd(); it.next()) {
+        items.push_back(it.value());
+    }
+    return items;
+}
+
+//  Like map, but calls f on the workers of the thread pool, see
+//  ThreadPool::parallelFor, so in no particular order.
+BUILTIN("pmap")
+{
+    CHECK_ARGS_IS(2);
+    malValuePtr op = *argsBegin++; // this gets checked in APPLY
+    malValueVec source = sequenceItems(*argsBegin);
+
+    const int length = source.size();
+    std::unique_ptr<malValueVec> items(new malValueVec(length));
+    auto it = source.begin();
+    ThreadPool::parallelFor(length, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            items->at(i) = APPLY(op, it+i, it+i+1);
+        }
+    });
+
+    return mal::list(items.release());
+}
+
+//  Reduces a sequence with f in parallel, reducing each chunk of it
+//  from init, then the chunks' results in order with combine, which
+//  defaults to f. So f and combine must be associative, and init must be an
+//  identity of f, as 0 is of +.
+BUILTIN("preduce")
+{
+    int argCount = CHECK_ARGS_BETWEEN(3, 4);
+    malValuePtr op = *argsBegin++; // these get checked in APPLY
+    malValuePtr combine = (argCount == 4) ? *argsBegin++ : op;
+    malValuePtr init = *argsBegin++;
+    malValueVec source = sequenceItems(*argsBegin);
+
+    std::vector<std::pair<int, malValuePtr> > chunks;
+    SpinLock chunksLock;
+    auto it = source.begin();
+    ThreadPool::parallelFor(source.size(), [&](int begin, int end) {
+        malValueVec args(2, init);
+        for (int i = begin; i < end; i++) {
+            args[1] = it[i];
+            args[0] = APPLY(op, args.begin(), args.end());
+        }
+        LockGuard<SpinLock> lock(chunksLock);
+        chunks.push_back(std::make_pair(begin, args[0]));
+    });
+    if (chunks.empty()) {
+        return init;
+    }
+
+    std::sort(chunks.begin(), chunks.end(),
+              [](const std::pair<int, malValuePtr>& a,
+                 const std::pair<int, malValuePtr>& b) {
+                  return a.first < b.first;
+              });
+    malValueVec args(2, chunks[0].second);
+    for (size_t i = 1; i < chunks.size(); i++) {
+        args[1] = chunks[i].second;
+        args[0] = APPLY(combine, args.begin(), args.end());
+    }
+    return args[0];
+}
+
+BUILTIN("profile-start")
+{
+    CHECK_ARGS_IS(0);
+    Profiler::start();
+    return mal::nilValue();
+}
+
+//  Prints the profile table, and writes the folded stacks to a file if one
+//  is given.
+BUILTIN("profile-stop")
+{
+    int argCount = CHECK_ARGS_BETWEEN(0, 1);
+    Profiler::stop();
+    std::cout << Profiler::report();
+    if (argCount == 1) {
+        ARG(malString, filename);
+        Profiler::writeFoldedStacks(filename->value());
+    }
+    return mal::nilValue();
+}
+
+BUILTIN("promise")
+{
+    CHECK_ARGS_IS(0);
+    return mal::promise();
+}
+
 BUILTIN("pr-str")
 {
     return mal::string(printValues(argsBegin, argsEnd, " ", true));
@@ -382,11 +1226,34 @@ BUILTIN("prn")
     return mal::nilValue();
 }
 
+BUILTIN("range")
+{
+    int argCount = CHECK_ARGS_BETWEEN(0, 3);
+    if (argCount == 0) {
+        return mal::lazySeq(new RangeGenerator(0, 0, 1, true));
+    }
+
+    int64_t start = 0, step = 1;
+    if (argCount > 1) {
+        ARG(malInteger, startArg);
+        start = startArg->value();
+    }
+    ARG(malInteger, end);
+    if (argCount > 2) {
+        ARG(malInteger, stepArg);
+        step = stepArg->value();
+        MAL_CHECK(step != 0, "range step must not be zero");
+    }
+
+    return mal::lazySeq(new RangeGenerator(start, end->value(), step, false));
+}
+
 BUILTIN("read-string")
 {
     CHECK_ARGS_IS(1);
     ARG(malString, str);
 
+    Tracer::Span span("read", "read-string");
     return readStr(str->value());
 }
 
@@ -398,6 +1265,47 @@ BUILTIN("readline")
     return readline(str->value());
 }
 
+BUILTIN("realized?")
+{
+    CHECK_ARGS_IS(1);
+    ARG(malFuture, future);
+    return mal::boolean(future->isRealised());
+}
+
+BUILTIN("reduce")
+{
+    int argCount = CHECK_ARGS_BETWEEN(2, 3);
+    malValuePtr op = *argsBegin++;
+    if (argCount == 3) {
+        malValuePtr init = *argsBegin++;
+        return transduce(malTransducer::StepVec(), op, init, *argsBegin);
+    }
+
+    // Without an initial value, start from the first item, or return the
+    // result of calling op with no arguments if there are none.
+    malIterator it(*argsBegin);
+    if (it.atEnd()) {
+        malValueVec args;
+        return APPLY(op, args.begin(), args.end());
+    }
+    malValuePtr init = it.value();
+    it.next();
+    return transduce(malTransducer::StepVec(), op, init, it.rest());
+}
+
+BUILTIN("remove")
+{
+    int argCount = CHECK_ARGS_BETWEEN(1, 2);
+    malValuePtr pred = *argsBegin++; // this gets checked in APPLY
+    if (argCount == 1) {
+        return transducerStep(malTransducer::REMOVE, pred, 0);
+    }
+    malValuePtr source = *argsBegin;
+    malIterator check(source); // throws if it isn't a sequence
+
+    return mal::lazySeq(new FilterGenerator(pred, source, true));
+}
+
 BUILTIN("reset!")
 {
     CHECK_ARGS_IS(2);
@@ -411,10 +1319,31 @@ BUILTIN("rest")
     if (*argsBegin == mal::nilValue()) {
         return mal::list(new malValueVec(0));
     }
+    if (const malLazySeq* lazy = DYNAMIC_CAST(malLazySeq, *argsBegin)) {
+        return lazy->rest();
+    }
     ARG(malSequence, seq);
     return seq->rest();
 }
 
+BUILTIN("runtime-stats")
+{
+    CHECK_ARGS_IS(0);
+    return RuntimeStats::asHash();
+}
+
+//  Saves the interpreter's root environment, and everything it holds, for
+//  --image to load. See Image.h.
+BUILTIN("save-image")
+{
+    CHECK_ARGS_IS(1);
+    ARG(malString, filename);
+    malEnvPtr env = Interpreter::currentEnv();
+    MAL_CHECK(env, "There is no interpreter to save");
+    Image::save(env->getRoot(), filename->value());
+    return mal::nilValue();
+}
+
 BUILTIN("seq")
 {
     CHECK_ARGS_IS(1);
@@ -426,6 +1355,9 @@ BUILTIN("seq")
         return seq->isEmpty() ? mal::nilValue()
                               : mal::list(seq->begin(), seq->end());
     }
+    if (const malLazySeq* lazy = DYNAMIC_CAST(malLazySeq, arg)) {
+        return lazy->isEmpty() ? mal::nilValue() : arg;
+    }
     if (const malString* strVal = DYNAMIC_CAST(malString, arg)) {
         const String str = strVal->value();
         int length = str.length();
@@ -442,43 +1374,82 @@ BUILTIN("seq")
 }
 
 
+BUILTIN("sequential?")
+{
+    CHECK_ARGS_IS(1);
+    return mal::boolean(mal::isSequential((*argsBegin).ptr()));
+}
+
 BUILTIN("slurp")
 {
     CHECK_ARGS_IS(1);
     ARG(malString, filename);
+    Tracer::Span span("io", "slurp", filename->value());
+    return mal::string(readFile(filename->value()));
+}
 
-    std::ios_base::openmode openmode =
-        std::ios::ate | std::ios::in | std::ios::binary;
-    std::ifstream file(filename->value().c_str(), openmode);
-    MAL_CHECK(!file.fail(), "Cannot open %s", filename->value().c_str());
-
-    String data;
-    data.reserve(file.tellg());
-    file.seekg(0, std::ios::beg);
-    data.append(std::istreambuf_iterator<char>(file.rdbuf()),
-                std::istreambuf_iterator<char>());
+BUILTIN("some")
+{
+    CHECK_ARGS_IS(2);
+    Caller pred(*argsBegin++, 1);
 
-    return mal::string(data);
+    for (malIterator it(*argsBegin); !it.atEnd(); it.next()) {
+        malValuePtr value = pred(it.value());
+        if (value->isTrue()) {
+            return value;
+        }
+    }
+    return mal::nilValue();
 }
 
-BUILTIN("str")
+PURE_BUILTIN("str")
 {
     return mal::string(printValues(argsBegin, argsEnd, "", false));
 }
 
+// Sets an atom to the result of applying op to its value and args, calling
+// op again if another thread changes the value meanwhile, so op should have
+// no side effects. Returns the value replaced, and sets value to the new.
+static malValuePtr swapAtom(malAtom* atom, malValuePtr op,
+                            malValueIter argsBegin, malValueIter argsEnd,
+                            malValuePtr& value)
+{
+    malValueVec args(1 + argsEnd - argsBegin);
+    std::copy(argsBegin, argsEnd, args.begin() + 1);
+    for (;;) {
+        args[0] = atom->deref();
+        value = APPLY(op, args.begin(), args.end());
+        if (atom->compareAndSet(args[0], value)) {
+            return args[0];
+        }
+        RuntimeStats::addAtomRetries(1);
+    }
+}
+
 BUILTIN("swap!")
 {
     CHECK_ARGS_AT_LEAST(2);
     ARG(malAtom, atom);
-
     malValuePtr op = *argsBegin++; // this gets checked in APPLY
 
-    malValueVec args(1 + argsEnd - argsBegin);
-    args[0] = atom->deref();
-    std::copy(argsBegin, argsEnd, args.begin() + 1);
+    malValuePtr value;
+    swapAtom(atom, op, argsBegin, argsEnd, value);
+    return value;
+}
+
+//  Like swap!, but returns a vector of the old value and the new.
+BUILTIN("swap-vals!")
+{
+    CHECK_ARGS_AT_LEAST(2);
+    ARG(malAtom, atom);
+    malValuePtr op = *argsBegin++; // this gets checked in APPLY
 
-    malValuePtr value = APPLY(op, args.begin(), args.end());
-    return atom->reset(value);
+    malValuePtr value;
+    malValuePtr previous = swapAtom(atom, op, argsBegin, argsEnd, value);
+    malValueVec* items = new malValueVec(2);
+    items->at(0) = previous;
+    items->at(1) = value;
+    return mal::vector(items);
 }
 
 BUILTIN("symbol")
@@ -488,6 +1459,20 @@ BUILTIN("symbol")
     return mal::symbol(token->value());
 }
 
+BUILTIN("take")
+{
+    int argCount = CHECK_ARGS_BETWEEN(1, 2);
+    ARG(malInteger, count);
+    if (argCount == 1) {
+        return transducerStep(malTransducer::TAKE, NULL, count->value());
+    }
+
+    malValuePtr source = *argsBegin;
+    malIterator check(source); // throws if it isn't a sequence
+
+    return mal::lazySeq(new TakeGenerator(count->value(), source));
+}
+
 BUILTIN("throw")
 {
     CHECK_ARGS_IS(1);
@@ -506,6 +1491,70 @@ BUILTIN("time-ms")
     return mal::integer(ms.count());
 }
 
+//  Unlike time-ms, time-ns is monotonic, so it's only useful for measuring
+//  intervals.
+BUILTIN("time-ns")
+{
+    CHECK_ARGS_IS(0);
+    return mal::integer(monotonicNs());
+}
+
+//  The CPU time used by the process so far.
+BUILTIN("cpu-time-ns")
+{
+    CHECK_ARGS_IS(0);
+
+    struct timespec ts;
+    MAL_CHECK(clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) == 0,
+              "CPU time is not available");
+    return mal::integer((int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+BUILTIN("trace-start")
+{
+    int argCount = CHECK_ARGS_BETWEEN(0, 1);
+    int64_t thresholdNs = Tracer::DEFAULT_LAMBDA_THRESHOLD_NS;
+    if (argCount == 1) {
+        ARG(malInteger, thresholdUs);
+        MAL_CHECK(thresholdUs->value() >= 0,
+                  "trace threshold must not be negative");
+        thresholdNs = thresholdUs->value() * 1000;
+    }
+    Tracer::start(thresholdNs);
+    Profiler::start(Profiler::TRACING);
+    return mal::nilValue();
+}
+
+//  Writes the trace to a file if one is given.
+BUILTIN("trace-stop")
+{
+    int argCount = CHECK_ARGS_BETWEEN(0, 1);
+    Profiler::stop(Profiler::TRACING);
+    Tracer::stop();
+    if (argCount == 1) {
+        ARG(malString, filename);
+        Tracer::write(filename->value());
+    }
+    return mal::nilValue();
+}
+
+BUILTIN("transduce")
+{
+    int argCount = CHECK_ARGS_BETWEEN(3, 4);
+    ARG(malTransducer, xform);
+    malValuePtr op = *argsBegin++;
+
+    malValuePtr init;
+    if (argCount == 4) {
+        init = *argsBegin++;
+    }
+    else {
+        malValueVec args;
+        init = APPLY(op, args.begin(), args.end());
+    }
+    return transduce(xform->steps(), op, init, *argsBegin);
+}
+
 BUILTIN("vals")
 {
     CHECK_ARGS_IS(1);
@@ -516,6 +1565,21 @@ BUILTIN("vals")
 BUILTIN("vec")
 {
     CHECK_ARGS_IS(1);
+    if (DYNAMIC_CAST(malLazySeq, *argsBegin)) {
+        malValueVec* items = new malValueVec;
+        for (malIterator it(*argsBegin); !it.atEnd(); it.next()) {
+            items->push_back(it.value());
+        }
+        return mal::vector(items);
+    }
+    if (const malIntArray* array = DYNAMIC_CAST(malIntArray, *argsBegin)) {
+        malValueVec* items = new malValueVec;
+        items->reserve(array->count());
+        for (auto it = array->items().begin(); it != array->items().end(); ++it) {
+            items->push_back(mal::integer(*it));
+        }
+        return mal::vector(items);
+    }
     ARG(malSequence, s);
     return mal::vector(s->begin(), s->end());
 }
@@ -535,8 +1599,8 @@ BUILTIN("with-meta")
 
 void installCore(malEnvPtr env) {
     for (auto it = handlers.begin(), end = handlers.end(); it != end; ++it) {
-        malBuiltIn* handler = *it;
-        env->set(handler->name(), handler);
+        const malBuiltIn* handler = STATIC_CAST(malBuiltIn, *it);
+        env->set(handler->name(), *it);
     }
 }
 
@@ -557,3 +1621,18 @@ static String printValues(malValueIter begin, malValueIter end,
 
     return out;
 }
+
+static String readFile(const String& filename)
+{
+    std::ios_base::openmode openmode =
+        std::ios::ate | std::ios::in | std::ios::binary;
+    std::ifstream file(filename.c_str(), openmode);
+    MAL_CHECK(!file.fail(), "Cannot open %s", filename.c_str());
+
+    String data;
+    data.reserve(file.tellg());
+    file.seekg(0, std::ios::beg);
+    data.append(std::istreambuf_iterator<char>(file.rdbuf()),
+                std::istreambuf_iterator<char>());
+    return data;
+}
@@ -1,8 +1,31 @@
 #include "Environment.h"
+#include "Interpreter.h"
 #include "Types.h"
 
 #include <algorithm>
 
+// The current interpreter is kept here, rather than with the rest of it in
+// Interpreter.cpp, as the thread pool needs it, and all of the steps link
+// the thread pool but only step A has an interpreter.
+static MAL_THREAD_LOCAL malEnv* t_currentEnv = NULL;
+
+malEnvPtr Interpreter::currentEnv()
+{
+    return t_currentEnv;
+}
+
+Interpreter::Scope::Scope(malEnvPtr env)
+: m_env(env)
+, m_previous(t_currentEnv)
+{
+    t_currentEnv = env.ptr();
+}
+
+Interpreter::Scope::~Scope()
+{
+    t_currentEnv = m_previous;
+}
+
 malEnv::malEnv(malEnvPtr outer)
 : m_outer(outer)
 {
@@ -38,6 +61,7 @@ malEnv::~malEnv()
 malEnvPtr malEnv::find(const String& symbol)
 {
     for (malEnvPtr env = this; env; env = env->m_outer) {
+        SharedLockGuard lock(env->m_lock);
         if (env->m_map.find(symbol) != env->m_map.end()) {
             return env;
         }
@@ -48,6 +72,7 @@ malEnvPtr malEnv::find(const String& symbol)
 malValuePtr malEnv::get(const String& symbol)
 {
     for (malEnvPtr env = this; env; env = env->m_outer) {
+        SharedLockGuard lock(env->m_lock);
         auto it = env->m_map.find(symbol);
         if (it != env->m_map.end()) {
             return it->second;
@@ -58,10 +83,26 @@ malValuePtr malEnv::get(const String& symbol)
 
 malValuePtr malEnv::set(const String& symbol, malValuePtr value)
 {
+    LockGuard<SharedLock> lock(m_lock);
     m_map[symbol] = value;
     return value;
 }
 
+malEnv::Map malEnv::bindings()
+{
+    SharedLockGuard lock(m_lock);
+    return m_map;
+}
+
+void malEnv::clear()
+{
+    Map map; // freed after the lock is released
+    {
+        LockGuard<SharedLock> lock(m_lock);
+        m_map.swap(map);
+    }
+}
+
 malEnvPtr malEnv::getRoot()
 {
     // Work our way down the the global environment.
@@ -2,11 +2,14 @@
 #define INCLUDE_ENVIRONMENT_H
 
 #include "MAL.h"
+#include "RuntimeStats.h"
 
 #include <map>
 
 class malEnv : public RefCounted {
 public:
+    COUNTED(malEnv);
+
     malEnv(malEnvPtr outer = NULL);
     malEnv(malEnvPtr outer,
            const StringVec& bindings,
@@ -15,13 +18,24 @@ public:
 
     ~malEnv();
 
+    typedef std::map<String, malValuePtr> Map;
+
     malValuePtr get(const String& symbol);
     malEnvPtr   find(const String& symbol);
     malValuePtr set(const String& symbol, malValuePtr value);
     malEnvPtr   getRoot();
 
+    // A copy of this environment's own bindings, and the one it's inside,
+    // for saving images.
+    Map       bindings();
+    malEnvPtr outer() const { return m_outer; }
+
+    // Drops all of this environment's bindings. Functions defined in an
+    // environment hold it, so it and they are only freed once it's cleared.
+    void clear();
+
 private:
-    typedef std::map<String, malValuePtr> Map;
+    SharedLock m_lock; // environments may be shared between threads
     Map m_map;
     malEnvPtr m_outer;
 };
@@ -0,0 +1,587 @@
+#include "Image.h"
+#include "Environment.h"
+#include "Tracer.h"
+#include "Types.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fstream>
+
+// An image is a header, then a record for each value and environment in
+// turn, each numbered from 1 in the order it appears. Records refer to
+// others by number, with 0 for none, and only to ones before them, so
+// values are written after everything they hold. Environments and atoms
+// can be part of cycles, so they're written empty, the first time they're
+// seen, and filled in by the records at the end. All numbers are written
+// as variable length integers, 7 bits to a byte, low bits first.
+static const char MAGIC[] = "MALIMAGE";
+static const uint64_t VERSION = 1;
+
+enum Tag {
+    TAG_NIL = 1, TAG_TRUE, TAG_FALSE,
+    TAG_INTEGER, TAG_STRING, TAG_KEYWORD, TAG_SYMBOL,
+    TAG_LIST, TAG_VECTOR, TAG_HASH, TAG_INT_ARRAY,
+    TAG_BUILTIN, TAG_LAMBDA, TAG_COMPOSITION, TAG_MEMOIZED, TAG_TRANSDUCER,
+    TAG_ROOT_ENV, TAG_ENV, TAG_ATOM,
+    TAG_ENV_BINDINGS, TAG_ATOM_VALUE,
+    TAG_END,
+};
+
+namespace {
+
+class ImageWriter {
+public:
+    ImageWriter() : m_nextId(1) { }
+
+    void writeRoot(malEnvPtr root);
+    String finish();
+
+private:
+    typedef std::pair<malValuePtr, bool> StackItem; // true once expanded
+
+    void addEnv(malEnv* env);
+    void addAtom(malAtom* atom);
+    void pushChildren(malValue* value);
+    void push(malValuePtr value);
+    void drain();
+    void writeValue(malValue* value);
+
+    uint64_t idOf(const void* object) {
+        auto it = m_ids.find(object);
+        MAL_CHECK(it != m_ids.end(), "Image is missing an object");
+        return it->second;
+    }
+    void newId(const void* object) { m_ids[object] = m_nextId++; }
+    bool hasId(const void* object) { return m_ids.count(object) != 0; }
+
+    void writeNumber(uint64_t n);
+    void writeInteger(int64_t n) {
+        writeNumber(((uint64_t)n << 1) ^ (uint64_t)(n >> 63));
+    }
+    void writeString(const String& s) {
+        writeNumber(s.size());
+        m_out += s;
+    }
+    void writeRef(malValuePtr value) {
+        writeNumber(value ? idOf(value.ptr()) : 0);
+    }
+
+    String m_out;
+    uint64_t m_nextId;
+    std::map<const void*, uint64_t> m_ids;
+    std::vector<StackItem> m_stack;
+
+    // The contents of environments and atoms, as they were when first
+    // seen, for the records at the end.
+    std::vector<std::pair<uint64_t, malEnv::Map> > m_envs;
+    std::vector<std::pair<uint64_t, malValuePtr> > m_atoms;
+};
+
+void ImageWriter::writeNumber(uint64_t n)
+{
+    while (n >= 0x80) {
+        m_out += (char)((n & 0x7f) | 0x80);
+        n >>= 7;
+    }
+    m_out += (char)n;
+}
+
+void ImageWriter::writeRoot(malEnvPtr root)
+{
+    m_out.append(MAGIC, sizeof(MAGIC) - 1);
+    writeNumber(VERSION);
+
+    newId(root.ptr());
+    m_out += (char)TAG_ROOT_ENV;
+    malEnv::Map bindings = root->bindings();
+    for (auto& it : bindings) {
+        push(it.second);
+    }
+    m_envs.push_back(std::make_pair(idOf(root.ptr()), bindings));
+    drain();
+}
+
+// Writes the environment, and those it's inside, outermost first.
+void ImageWriter::addEnv(malEnv* env)
+{
+    std::vector<malEnv*> chain;
+    for (malEnv* it = env; it && !hasId(it); it = it->outer().ptr()) {
+        chain.push_back(it);
+    }
+    for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+        malEnv* inner = *it;
+        malEnvPtr outer = inner->outer();
+        newId(inner);
+        m_out += (char)TAG_ENV;
+        writeNumber(outer ? idOf(outer.ptr()) : 0);
+        malEnv::Map bindings = inner->bindings();
+        for (auto& binding : bindings) {
+            push(binding.second);
+        }
+        m_envs.push_back(std::make_pair(idOf(inner), bindings));
+    }
+}
+
+void ImageWriter::addAtom(malAtom* atom)
+{
+    MAL_CHECK(atom->meta() == mal::nilValue(),
+              "Atoms with metadata can't be saved in an image");
+    newId(atom);
+    m_out += (char)TAG_ATOM;
+    malValuePtr value = atom->deref();
+    push(value);
+    m_atoms.push_back(std::make_pair(idOf(atom), value));
+}
+
+void ImageWriter::push(malValuePtr value)
+{
+    if (!hasId(value.ptr())) {
+        m_stack.push_back(StackItem(value, false));
+    }
+}
+
+// Values are written once all they hold has been, without recursing, so
+// deeply nested values can be saved.
+void ImageWriter::drain()
+{
+    while (!m_stack.empty()) {
+        StackItem item = m_stack.back();
+        m_stack.pop_back();
+        malValue* value = item.first.ptr();
+        if (hasId(value)) {
+            continue;
+        }
+        if (malAtom* atom = dynamic_cast<malAtom*>(value)) {
+            addAtom(atom);
+        }
+        else if (item.second) {
+            writeValue(value);
+        }
+        else {
+            m_stack.push_back(StackItem(item.first, true));
+            pushChildren(value);
+        }
+    }
+}
+
+void ImageWriter::pushChildren(malValue* value)
+{
+    if (value->meta() != mal::nilValue()) {
+        push(value->meta());
+    }
+    if (const malSequence* seq = dynamic_cast<malSequence*>(value)) {
+        for (auto it = seq->begin(); it != seq->end(); ++it) {
+            push(*it);
+        }
+    }
+    else if (const malHash* hash = dynamic_cast<malHash*>(value)) {
+        for (auto& it : hash->map()) {
+            push(it.second);
+        }
+    }
+    else if (const malLambda* lambda = dynamic_cast<malLambda*>(value)) {
+        addEnv(lambda->getEnv().ptr());
+        push(lambda->getBody());
+    }
+    else if (const malComposition* comp =
+                dynamic_cast<malComposition*>(value)) {
+        for (auto& it : comp->functions()) {
+            push(it);
+        }
+    }
+    else if (const malMemoized* memo = dynamic_cast<malMemoized*>(value)) {
+        push(memo->op());
+    }
+    else if (const malTransducer* xf = dynamic_cast<malTransducer*>(value)) {
+        for (auto& step : xf->steps()) {
+            if (step.op) {
+                push(step.op);
+            }
+        }
+    }
+}
+
+void ImageWriter::writeValue(malValue* value)
+{
+    // The constants are singletons, without metadata.
+    if (value == mal::nilValue().ptr() || value == mal::trueValue().ptr() ||
+        value == mal::falseValue().ptr()) {
+        m_out += (char)(value == mal::nilValue().ptr()  ? TAG_NIL :
+                        value == mal::trueValue().ptr() ? TAG_TRUE :
+                                                          TAG_FALSE);
+        newId(value);
+        return;
+    }
+
+    if (const malInteger* i = dynamic_cast<malInteger*>(value)) {
+        m_out += (char)TAG_INTEGER;
+        writeInteger(i->value());
+    }
+    else if (const malStringBase* s = dynamic_cast<malStringBase*>(value)) {
+        m_out += (char)(dynamic_cast<malString*>(value)  ? TAG_STRING :
+                        dynamic_cast<malKeyword*>(value) ? TAG_KEYWORD :
+                                                           TAG_SYMBOL);
+        writeString(s->value());
+    }
+    else if (const malSequence* seq = dynamic_cast<malSequence*>(value)) {
+        m_out += (char)(dynamic_cast<malList*>(value) ? TAG_LIST : TAG_VECTOR);
+        writeNumber(seq->count());
+        for (auto it = seq->begin(); it != seq->end(); ++it) {
+            writeRef(*it);
+        }
+    }
+    else if (const malHash* hash = dynamic_cast<malHash*>(value)) {
+        m_out += (char)TAG_HASH;
+        writeNumber(hash->isEvaluated());
+        writeNumber(hash->map().size());
+        for (auto& it : hash->map()) {
+            writeString(it.first);
+            writeRef(it.second);
+        }
+    }
+    else if (const malIntArray* ints = dynamic_cast<malIntArray*>(value)) {
+        m_out += (char)TAG_INT_ARRAY;
+        writeNumber(ints->count());
+        for (int64_t item : ints->items()) {
+            writeInteger(item);
+        }
+    }
+    else if (const malBuiltIn* builtIn = dynamic_cast<malBuiltIn*>(value)) {
+        m_out += (char)TAG_BUILTIN;
+        writeString(builtIn->name());
+    }
+    else if (const malLambda* lambda = dynamic_cast<malLambda*>(value)) {
+        m_out += (char)TAG_LAMBDA;
+        const StringVec& bindings = lambda->getBindings();
+        writeNumber(bindings.size());
+        for (auto& it : bindings) {
+            writeString(it);
+        }
+        writeRef(lambda->getBody());
+        writeNumber(idOf(lambda->getEnv().ptr()));
+        writeNumber(lambda->isMacro());
+        writeString(lambda->name());
+    }
+    else if (const malComposition* comp =
+                dynamic_cast<malComposition*>(value)) {
+        m_out += (char)TAG_COMPOSITION;
+        writeNumber(comp->functions().size());
+        for (auto& it : comp->functions()) {
+            writeRef(it);
+        }
+    }
+    else if (const malMemoized* memo = dynamic_cast<malMemoized*>(value)) {
+        m_out += (char)TAG_MEMOIZED;
+        writeRef(memo->op());
+        writeNumber(memo->capacity());
+    }
+    else if (const malTransducer* xf = dynamic_cast<malTransducer*>(value)) {
+        m_out += (char)TAG_TRANSDUCER;
+        writeNumber(xf->steps().size());
+        for (auto& step : xf->steps()) {
+            writeNumber(step.kind);
+            writeRef(step.op);
+            writeInteger(step.count);
+        }
+    }
+    else {
+        MAL_FAIL("%s can't be saved in an image", value->print(true).c_str());
+    }
+    malValuePtr meta = value->meta();
+    writeRef(meta == mal::nilValue() ? malValuePtr() : meta);
+    newId(value);
+}
+
+String ImageWriter::finish()
+{
+    for (auto& env : m_envs) {
+        m_out += (char)TAG_ENV_BINDINGS;
+        writeNumber(env.first);
+        writeNumber(env.second.size());
+        for (auto& it : env.second) {
+            writeString(it.first);
+            writeRef(it.second);
+        }
+    }
+    for (auto& atom : m_atoms) {
+        m_out += (char)TAG_ATOM_VALUE;
+        writeNumber(atom.first);
+        writeRef(atom.second);
+    }
+    m_out += (char)TAG_END;
+    return m_out;
+}
+
+class ImageReader {
+public:
+    ImageReader(const String& path, const char* data, size_t size)
+    : m_path(path), m_pos(data), m_end(data + size) { }
+
+    void readInto(malEnvPtr root);
+
+private:
+    // Each record's value or environment, indexed by its number.
+    struct Object {
+        malValuePtr value;
+        malEnvPtr   env;
+    };
+
+    malValuePtr readValue(int tag, malEnvPtr root);
+
+    uint64_t readNumber();
+    int64_t readInteger() {
+        uint64_t n = readNumber();
+        return (int64_t)(n >> 1) ^ -(int64_t)(n & 1);
+    }
+    String readString();
+    int readTag() { check(1); return (unsigned char)*m_pos++; }
+
+    Object& object(uint64_t id) {
+        MAL_CHECK((id > 0) && (id <= m_objects.size()),
+                  "%s is not a valid image", m_path.c_str());
+        return m_objects[id - 1];
+    }
+    malValuePtr readRef() {
+        uint64_t id = readNumber();
+        return id ? value(id) : malValuePtr();
+    }
+    malValuePtr value(uint64_t id) {
+        malValuePtr value = object(id).value;
+        MAL_CHECK(value, "%s is not a valid image", m_path.c_str());
+        return value;
+    }
+    malEnvPtr env(uint64_t id) {
+        malEnvPtr env = object(id).env;
+        MAL_CHECK(env, "%s is not a valid image", m_path.c_str());
+        return env;
+    }
+
+    void check(size_t length) {
+        MAL_CHECK((size_t)(m_end - m_pos) >= length,
+                  "%s is truncated", m_path.c_str());
+    }
+
+    const String m_path;
+    const char* m_pos;
+    const char* const m_end;
+    std::vector<Object> m_objects;
+};
+
+uint64_t ImageReader::readNumber()
+{
+    uint64_t n = 0;
+    for (int shift = 0; ; shift += 7) {
+        check(1);
+        MAL_CHECK(shift < 64, "%s is not a valid image", m_path.c_str());
+        unsigned char byte = *m_pos++;
+        n |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return n;
+        }
+    }
+}
+
+String ImageReader::readString()
+{
+    uint64_t length = readNumber();
+    check(length);
+    String s(m_pos, length);
+    m_pos += length;
+    return s;
+}
+
+void ImageReader::readInto(malEnvPtr root)
+{
+    const size_t magicLength = sizeof(MAGIC) - 1;
+    check(magicLength);
+    MAL_CHECK(memcmp(m_pos, MAGIC, magicLength) == 0,
+              "%s is not a mal image", m_path.c_str());
+    m_pos += magicLength;
+    MAL_CHECK(readNumber() == VERSION,
+              "%s is from another version of mal", m_path.c_str());
+
+    for (int tag = readTag(); tag != TAG_END; tag = readTag()) {
+        Object object;
+        if (tag == TAG_ROOT_ENV) {
+            object.env = root;
+        }
+        else if (tag == TAG_ENV) {
+            uint64_t outer = readNumber();
+            object.env = new malEnv(outer ? env(outer) : malEnvPtr());
+        }
+        else if (tag == TAG_ATOM) {
+            object.value = mal::atom(mal::nilValue());
+        }
+        else if (tag == TAG_ENV_BINDINGS) {
+            malEnvPtr target = env(readNumber());
+            for (uint64_t count = readNumber(); count > 0; count--) {
+                String name = readString();
+                target->set(name, value(readNumber()));
+            }
+            continue;
+        }
+        else if (tag == TAG_ATOM_VALUE) {
+            malValuePtr atom = value(readNumber());
+            MAL_CHECK(DYNAMIC_CAST(malAtom, atom),
+                      "%s is not a valid image", m_path.c_str());
+            STATIC_CAST(malAtom, atom)->reset(value(readNumber()));
+            continue;
+        }
+        else {
+            object.value = readValue(tag, root);
+        }
+        m_objects.push_back(object);
+    }
+}
+
+malValuePtr ImageReader::readValue(int tag, malEnvPtr root)
+{
+    malValuePtr result;
+    switch (tag) {
+        case TAG_NIL:     return mal::nilValue();
+        case TAG_TRUE:    return mal::trueValue();
+        case TAG_FALSE:   return mal::falseValue();
+        case TAG_INTEGER: result = mal::integer(readInteger()); break;
+        case TAG_STRING:  result = mal::string(readString()); break;
+        case TAG_KEYWORD: result = mal::keyword(readString()); break;
+        case TAG_SYMBOL:  result = mal::symbol(readString()); break;
+        case TAG_LIST:
+        case TAG_VECTOR: {
+            uint64_t count = readNumber();
+            malValueVec* items = new malValueVec;
+            items->reserve(std::min<uint64_t>(count, m_end - m_pos));
+            for ( ; count > 0; count--) {
+                items->push_back(value(readNumber()));
+            }
+            result = (tag == TAG_LIST) ? mal::list(items) : mal::vector(items);
+            break;
+        }
+        case TAG_HASH: {
+            bool isEvaluated = readNumber() != 0;
+            malHash::Map map;
+            for (uint64_t count = readNumber(); count > 0; count--) {
+                String key = readString();
+                map[key] = value(readNumber());
+            }
+            result = new malHash(map, isEvaluated);
+            break;
+        }
+        case TAG_INT_ARRAY: {
+            malIntArray::Vec* items = new malIntArray::Vec;
+            for (uint64_t count = readNumber(); count > 0; count--) {
+                items->push_back(readInteger());
+            }
+            result = mal::intArray(items);
+            break;
+        }
+        case TAG_BUILTIN: {
+            String name = readString();
+            result = root->get(name);
+            MAL_CHECK(DYNAMIC_CAST(malBuiltIn, result),
+                      "The builtin %s is not defined", name.c_str());
+            break;
+        }
+        case TAG_LAMBDA: {
+            StringVec bindings;
+            for (uint64_t count = readNumber(); count > 0; count--) {
+                bindings.push_back(readString());
+            }
+            malValuePtr body = value(readNumber());
+            malEnvPtr closure = env(readNumber());
+            bool isMacro = readNumber() != 0;
+            String name = readString();
+            malLambda* lambda = new malLambda(bindings, body, closure);
+            result = lambda;
+            if (isMacro) {
+                result = mal::macro(*lambda);
+            }
+            if (!name.empty()) {
+                STATIC_CAST(malLambda, result)->setName(name);
+            }
+            break;
+        }
+        case TAG_COMPOSITION: {
+            malValueVec functions;
+            for (uint64_t count = readNumber(); count > 0; count--) {
+                functions.push_back(value(readNumber()));
+            }
+            MAL_CHECK(!functions.empty(),
+                      "%s is not a valid image", m_path.c_str());
+            result = mal::composition(functions.begin(), functions.end());
+            break;
+        }
+        case TAG_MEMOIZED: {
+            malValuePtr op = value(readNumber());
+            result = mal::memoized(op, readNumber());
+            break;
+        }
+        case TAG_TRANSDUCER: {
+            malTransducer::StepVec steps;
+            for (uint64_t count = readNumber(); count > 0; count--) {
+                malTransducer::Step step;
+                uint64_t kind = readNumber();
+                step.op = readRef();
+                step.count = readInteger();
+                // Only take and drop have no function.
+                MAL_CHECK((kind <= malTransducer::DROP) &&
+                          (step.op || (kind >= malTransducer::TAKE)),
+                          "%s is not a valid image", m_path.c_str());
+                step.kind = (malTransducer::Kind)kind;
+                steps.push_back(step);
+            }
+            result = mal::transducer(steps);
+            break;
+        }
+        default:
+            MAL_FAIL("%s is not a valid image", m_path.c_str());
+    }
+    if (malValuePtr meta = readRef()) {
+        result = result->withMeta(meta);
+    }
+    return result;
+}
+
+}
+
+void Image::save(malEnvPtr root, const String& path)
+{
+    Tracer::Span span("io", "save-image", path);
+    ImageWriter writer;
+    writer.writeRoot(root);
+    String image = writer.finish();
+
+    std::ofstream file(path.c_str(), std::ios::out | std::ios::binary);
+    MAL_CHECK(!file.fail(), "Cannot open %s", path.c_str());
+    file.write(image.data(), image.size());
+    file.close();
+    MAL_CHECK(!file.fail(), "Cannot write %s", path.c_str());
+}
+
+void Image::load(malEnvPtr root, const String& path)
+{
+    Tracer::Span span("io", "load-image", path);
+    int fd = open(path.c_str(), O_RDONLY);
+    MAL_CHECK(fd >= 0, "Cannot open %s", path.c_str());
+    struct stat info;
+    if ((fstat(fd, &info) < 0) || (info.st_size == 0)) {
+        close(fd);
+        MAL_FAIL("%s is not a mal image", path.c_str());
+    }
+    void* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    MAL_CHECK(data != MAP_FAILED, "Cannot read %s", path.c_str());
+
+    try {
+        ImageReader reader(path, (const char*)data, info.st_size);
+        reader.readInto(root);
+    }
+    catch (...) {
+        munmap(data, info.st_size);
+        throw;
+    }
+    munmap(data, info.st_size);
+}
@@ -0,0 +1,22 @@
+#ifndef INCLUDE_IMAGE_H
+#define INCLUDE_IMAGE_H
+
+#include "MAL.h"
+
+// Saves everything reachable from a root environment to a file, and loads
+// it back into another, so that a program's libraries can be loaded once
+// and started from quickly after. Images hold numbers, strings, keywords,
+// symbols, collections, int arrays, atoms, builtins by name, and functions
+// and macros with their bodies and the environments they close over, along
+// with any metadata. Lazy sequences, futures and promises can't be saved,
+// nor can atoms with metadata.
+class Image {
+public:
+    static void save(malEnvPtr root, const String& path);
+
+    // Adds the image's bindings to root, replacing any it has already.
+    // Builtins are found by name in root as it was before.
+    static void load(malEnvPtr root, const String& path);
+};
+
+#endif // INCLUDE_IMAGE_H
@@ -0,0 +1,295 @@
+#include "IntKernels.h"
+
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MAL_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+// Each implementation provides loops which can't overflow, given inputs the
+// caller has checked the bounds of, along with an overflow checked add.
+struct Kernels {
+    const char* name;
+
+    int64_t (*sum)(const int64_t* items, size_t count);
+    void    (*minMax)(const int64_t* items, size_t count,
+                      int64_t* min, int64_t* max);
+    bool    (*add)(const int64_t* lhs, const int64_t* rhs, size_t count,
+                   int64_t* result);
+    // Sums the products of values which all fit in 32 bits.
+    int64_t (*dot32)(const int64_t* lhs, const int64_t* rhs, size_t count);
+};
+
+static int64_t scalarSum(const int64_t* items, size_t count)
+{
+    int64_t sum = 0;
+    for (size_t i = 0; i < count; i++) {
+        sum += items[i];
+    }
+    return sum;
+}
+
+static void scalarMinMax(const int64_t* items, size_t count,
+                         int64_t* min, int64_t* max)
+{
+    int64_t lo = items[0], hi = items[0];
+    for (size_t i = 1; i < count; i++) {
+        lo = std::min(lo, items[i]);
+        hi = std::max(hi, items[i]);
+    }
+    *min = lo;
+    *max = hi;
+}
+
+static bool scalarAdd(const int64_t* lhs, const int64_t* rhs, size_t count,
+                      int64_t* result)
+{
+    for (size_t i = 0; i < count; i++) {
+        if (__builtin_add_overflow(lhs[i], rhs[i], &result[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int64_t scalarDot32(const int64_t* lhs, const int64_t* rhs,
+                           size_t count)
+{
+    int64_t sum = 0;
+    for (size_t i = 0; i < count; i++) {
+        sum += lhs[i] * rhs[i];
+    }
+    return sum;
+}
+
+#ifdef MAL_X86_KERNELS
+
+// SSE2 has 64 bit adds, but no 64 bit compares or multiplies, so min/max and
+// dot products use the scalar loops.
+
+#define SSE2 __attribute__((target("sse2")))
+
+SSE2 static int64_t sse2Sum(const int64_t* items, size_t count)
+{
+    __m128i acc = _mm_setzero_si128();
+    size_t i = 0;
+    for ( ; i + 2 <= count; i += 2) {
+        acc = _mm_add_epi64(acc,
+            _mm_loadu_si128((const __m128i*)(items + i)));
+    }
+
+    int64_t lanes[2];
+    _mm_storeu_si128((__m128i*)lanes, acc);
+    return lanes[0] + lanes[1] + scalarSum(items + i, count - i);
+}
+
+SSE2 static bool sse2Add(const int64_t* lhs, const int64_t* rhs, size_t count,
+                         int64_t* result)
+{
+    // An add overflowed if the sign of its result differs from the signs of
+    // both operands.
+    __m128i overflow = _mm_setzero_si128();
+    size_t i = 0;
+    for ( ; i + 2 <= count; i += 2) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(lhs + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(rhs + i));
+        __m128i r = _mm_add_epi64(a, b);
+        overflow = _mm_or_si128(overflow, _mm_and_si128(
+            _mm_xor_si128(a, r), _mm_xor_si128(b, r)));
+        _mm_storeu_si128((__m128i*)(result + i), r);
+    }
+    if (_mm_movemask_pd(_mm_castsi128_pd(overflow)) != 0) {
+        return false;
+    }
+    return scalarAdd(lhs + i, rhs + i, count - i, result + i);
+}
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static int64_t avx2Sum(const int64_t* items, size_t count)
+{
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for ( ; i + 4 <= count; i += 4) {
+        acc = _mm256_add_epi64(acc,
+            _mm256_loadu_si256((const __m256i*)(items + i)));
+    }
+
+    int64_t lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, acc);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3]
+         + scalarSum(items + i, count - i);
+}
+
+AVX2 static void avx2MinMax(const int64_t* items, size_t count,
+                            int64_t* min, int64_t* max)
+{
+    if (count < 4) {
+        scalarMinMax(items, count, min, max);
+        return;
+    }
+
+    __m256i lo = _mm256_loadu_si256((const __m256i*)items);
+    __m256i hi = lo;
+    size_t i = 4;
+    for ( ; i + 4 <= count; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(items + i));
+        lo = _mm256_blendv_epi8(lo, v, _mm256_cmpgt_epi64(lo, v));
+        hi = _mm256_blendv_epi8(hi, v, _mm256_cmpgt_epi64(v, hi));
+    }
+
+    int64_t los[4], his[4];
+    _mm256_storeu_si256((__m256i*)los, lo);
+    _mm256_storeu_si256((__m256i*)his, hi);
+    int64_t unused;
+    scalarMinMax(los, 4, min, &unused);
+    scalarMinMax(his, 4, &unused, max);
+    if (i < count) {
+        int64_t tailMin, tailMax;
+        scalarMinMax(items + i, count - i, &tailMin, &tailMax);
+        *min = std::min(*min, tailMin);
+        *max = std::max(*max, tailMax);
+    }
+}
+
+AVX2 static bool avx2Add(const int64_t* lhs, const int64_t* rhs, size_t count,
+                         int64_t* result)
+{
+    __m256i overflow = _mm256_setzero_si256();
+    size_t i = 0;
+    for ( ; i + 4 <= count; i += 4) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(lhs + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(rhs + i));
+        __m256i r = _mm256_add_epi64(a, b);
+        overflow = _mm256_or_si256(overflow, _mm256_and_si256(
+            _mm256_xor_si256(a, r), _mm256_xor_si256(b, r)));
+        _mm256_storeu_si256((__m256i*)(result + i), r);
+    }
+    if (_mm256_movemask_pd(_mm256_castsi256_pd(overflow)) != 0) {
+        return false;
+    }
+    return scalarAdd(lhs + i, rhs + i, count - i, result + i);
+}
+
+AVX2 static int64_t avx2Dot32(const int64_t* lhs, const int64_t* rhs,
+                              size_t count)
+{
+    // _mm256_mul_epi32 multiplies the signed low halves of each lane.
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for ( ; i + 4 <= count; i += 4) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(lhs + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(rhs + i));
+        acc = _mm256_add_epi64(acc, _mm256_mul_epi32(a, b));
+    }
+
+    int64_t lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, acc);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3]
+         + scalarDot32(lhs + i, rhs + i, count - i);
+}
+
+#endif // MAL_X86_KERNELS
+
+static const Kernels& kernels()
+{
+    static const Kernels scalar = {
+        "scalar", scalarSum, scalarMinMax, scalarAdd, scalarDot32
+    };
+#ifdef MAL_X86_KERNELS
+    static const Kernels sse2 = {
+        "sse2", sse2Sum, scalarMinMax, sse2Add, scalarDot32
+    };
+    static const Kernels avx2 = {
+        "avx2", avx2Sum, avx2MinMax, avx2Add, avx2Dot32
+    };
+    static const Kernels& best =
+        __builtin_cpu_supports("avx2") ? avx2 :
+        __builtin_cpu_supports("sse2") ? sse2 : scalar;
+    return best;
+#else
+    return scalar;
+#endif
+}
+
+bool intSum(const int64_t* items, size_t count, int64_t* result)
+{
+    if (count == 0) {
+        *result = 0;
+        return true;
+    }
+
+    // If no item is big enough for count of them to overflow, no partial
+    // sum can either, so the vector loop is safe.
+    int64_t min, max;
+    kernels().minMax(items, count, &min, &max);
+    const int64_t limit = INT64_MAX / (int64_t)count;
+    if ((max <= limit) && (min >= -limit)) {
+        *result = kernels().sum(items, count);
+        return true;
+    }
+
+    int64_t sum = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (__builtin_add_overflow(sum, items[i], &sum)) {
+            return false;
+        }
+    }
+    *result = sum;
+    return true;
+}
+
+bool intAdd(const int64_t* lhs, const int64_t* rhs, size_t count,
+            int64_t* result)
+{
+    return kernels().add(lhs, rhs, count, result);
+}
+
+static int64_t magnitude(int64_t min, int64_t max)
+{
+    return std::max(-min, max);
+}
+
+bool intDot(const int64_t* lhs, const int64_t* rhs, size_t count,
+            int64_t* result)
+{
+    if (count == 0) {
+        *result = 0;
+        return true;
+    }
+
+    // Values which fit in 32 bits can use 32 bit multiplies, and if count of
+    // the largest possible product can't overflow, neither can the sum.
+    int64_t lhsMin, lhsMax, rhsMin, rhsMax, bound;
+    kernels().minMax(lhs, count, &lhsMin, &lhsMax);
+    kernels().minMax(rhs, count, &rhsMin, &rhsMax);
+    if ((lhsMin >= INT32_MIN) && (lhsMax <= INT32_MAX) &&
+        (rhsMin >= INT32_MIN) && (rhsMax <= INT32_MAX) &&
+        !__builtin_mul_overflow(magnitude(lhsMin, lhsMax)
+                                    * magnitude(rhsMin, rhsMax),
+                                (int64_t)count, &bound)) {
+        *result = kernels().dot32(lhs, rhs, count);
+        return true;
+    }
+
+    int64_t sum = 0, product;
+    for (size_t i = 0; i < count; i++) {
+        if (__builtin_mul_overflow(lhs[i], rhs[i], &product) ||
+            __builtin_add_overflow(sum, product, &sum)) {
+            return false;
+        }
+    }
+    *result = sum;
+    return true;
+}
+
+void intMinMax(const int64_t* items, size_t count, int64_t* min, int64_t* max)
+{
+    kernels().minMax(items, count, min, max);
+}
+
+const char* intKernelsName()
+{
+    return kernels().name;
+}
@@ -0,0 +1,27 @@
+#ifndef INCLUDE_INTKERNELS_H
+#define INCLUDE_INTKERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Inner loops for the int-array builtins. The best implementation the CPU
+// supports (AVX2, SSE2 or plain C++) is chosen the first time one is used.
+//
+// Like the arithmetic builtins, these fail rather than wrapping on overflow:
+// the functions returning bool return false if the result overflowed.
+
+bool intSum(const int64_t* items, size_t count, int64_t* result);
+
+bool intAdd(const int64_t* lhs, const int64_t* rhs, size_t count,
+            int64_t* result);
+
+bool intDot(const int64_t* lhs, const int64_t* rhs, size_t count,
+            int64_t* result);
+
+// count must be at least 1.
+void intMinMax(const int64_t* items, size_t count, int64_t* min, int64_t* max);
+
+// The name of the implementation in use.
+const char* intKernelsName();
+
+#endif // INCLUDE_INTKERNELS_H
@@ -0,0 +1,67 @@
+#include "Interpreter.h"
+#include "Environment.h"
+#include "Types.h"
+
+//  Functions, macros and constants implemented in MAL.
+static const char* malFunctionTable[] = {
+    "(defmacro! cond (fn* (& xs) (cons 'cond* xs)))",
+    "(def! *host-language* \"C++\")",
+    "(defmacro! future (fn* (& body) `(future-call (fn* () ~@body))))",
+};
+
+Interpreter::Interpreter()
+: m_env(new malEnv)
+{
+    Scope scope(m_env);
+    installCore(m_env);
+    for (auto &function : malFunctionTable) {
+        ::rep(function, m_env);
+    }
+    m_env->set("*ARGV*", mal::list(new malValueVec));
+}
+
+Interpreter::~Interpreter()
+{
+    m_env->clear();
+}
+
+malValuePtr Interpreter::eval(const String& input)
+{
+    return eval(readStr(input));
+}
+
+malValuePtr Interpreter::eval(malValuePtr ast)
+{
+    Scope scope(m_env);
+    return EVAL(ast, m_env);
+}
+
+String Interpreter::rep(const String& input)
+{
+    Scope scope(m_env);
+    return ::rep(input, m_env);
+}
+
+Interpreter::Script Interpreter::compile(const String& source)
+{
+    // The nil gives empty source a value, and the newline ends any comment
+    // on the last line.
+    return Script(readStr("(do nil " + source + "\n)"));
+}
+
+void Interpreter::define(const String& name, malValuePtr value)
+{
+    m_env->set(name, value);
+}
+
+void Interpreter::define(const String& name,
+                         const malBuiltIn::Function& function)
+{
+    m_env->set(name, mal::builtin(name, function));
+}
+
+malValuePtr Interpreter::apply(malValuePtr function, malValueVec& args)
+{
+    Scope scope(m_env);
+    return APPLY(function, args.begin(), args.end());
+}
@@ -0,0 +1,152 @@
+#ifndef INCLUDE_INTERPRETER_H
+#define INCLUDE_INTERPRETER_H
+
+#include "Environment.h"
+#include "MAL.h"
+#include "Native.h"
+
+// The header for programs which embed mal. They link with libmal.a, which
+// holds the step A evaluator, and -lreadline -lhistory, and -pthread too in
+// THREADS=1 builds.
+//
+// Each Interpreter has a root environment of its own, holding the core
+// builtins, the prelude and whatever its programs define, so any number may
+// run in one process without seeing each other's definitions. They share
+// only values which never change, like the builtins and nil, and process
+// wide tools like the profiler. In THREADS=1 builds different threads may
+// use different interpreters at once; otherwise, they must all be used from
+// the same thread.
+//
+// Values pass between C++ and mal without going through the printer or the
+// reader, converted as NativeValue describes:
+//
+//     Interpreter interpreter;
+//     interpreter.define("shout", [](const String& s) { return s + "!"; });
+//     Interpreter::Script script = interpreter.compile(source);
+//     interpreter.run(script);
+//     int64_t total = interpreter.call<int64_t>("total", items);
+//
+// Evaluation throws as EVAL does: a malValuePtr for (throw), a String for
+// other errors, and malEmptyInputException for input with no forms.
+class Interpreter {
+public:
+    Interpreter();
+
+    // Clears the root environment, to free what was defined in it, so
+    // functions taken from the interpreter can't be called after.
+    ~Interpreter();
+
+    malEnvPtr env() const { return m_env; }
+
+    // Reads the first form in input, and evaluates it.
+    malValuePtr eval(const String& input);
+
+    // Evaluates a form in the root environment.
+    malValuePtr eval(malValuePtr ast);
+
+    // Reads, evaluates and prints, as the REPL does.
+    String rep(const String& input);
+
+    // Source which has been read, ready to run any number of times. The
+    // forms keep their macro expansions and folded constants between runs,
+    // so only the first pays for them.
+    class Script {
+    public:
+        Script() { }
+
+    private:
+        friend class Interpreter;
+        Script(malValuePtr form) : m_form(form) { }
+
+        malValuePtr m_form;
+    };
+
+    // Reads all of the forms in source, which may be none.
+    Script compile(const String& source);
+
+    // Evaluates the forms of a script in turn, returning the last value,
+    // or nil if there are none.
+    template <class R = malValuePtr>
+    R run(const Script& script) {
+        MAL_CHECK(script.m_form, "The script has not been compiled");
+        return NativeType<R>::type::fromValue(eval(script.m_form));
+    }
+
+    // Calls a function, or the function defined as name, with arguments
+    // converted from C++.
+    template <class R = malValuePtr, class... Args>
+    R call(malValuePtr function, const Args&... args) {
+        malValueVec items { NativeType<Args>::type::toValue(args)... };
+        return NativeType<R>::type::fromValue(apply(function, items));
+    }
+
+    template <class R = malValuePtr, class... Args>
+    R call(const String& name, const Args&... args) {
+        return call<R>(m_env->get(name), args...);
+    }
+
+    // Defines name in the root environment. C++ functions become builtins,
+    // which take their arguments as mal values, or converted to the
+    // function's parameter types.
+    void define(const String& name, malValuePtr value);
+    void define(const String& name, const malBuiltIn::Function& function);
+
+    template <class R, class... Args>
+    void define(const String& name, R (*function)(Args...)) {
+        define(name, std::function<R(Args...)>(function));
+    }
+
+    template <class R, class... Args>
+    void define(const String& name,
+                const std::function<R(Args...)>& function) {
+        define(name, malBuiltIn::Function(
+            NativeFunction<R, Args...>(function)));
+    }
+
+    // Lambdas convert to builtins with the parameters of their call
+    // operator, unless they take mal values as builtins do.
+    template <class F>
+    typename std::enable_if<
+        !std::is_convertible<F, malBuiltIn::Function>::value>::type
+    define(const String& name, const F& function) {
+        define(name, function, &F::operator());
+    }
+
+    // The environment which (eval) and load-file evaluate in on this
+    // thread, or NULL if there's none. That's the root environment of the
+    // interpreter evaluating, or the environment of a server connection.
+    static malEnvPtr currentEnv();
+
+    // Makes env the current environment on this thread, for as long as the
+    // scope lasts. Interpreters do this around evaluations, the thread pool
+    // around tasks, for the environment which queued them, and the server
+    // around requests.
+    class Scope {
+    public:
+        Scope(malEnvPtr env);
+        ~Scope();
+
+    private:
+        Scope(const Scope&);
+        Scope& operator = (const Scope&);
+
+        malEnvPtr m_env;
+        malEnv*   m_previous;
+    };
+
+private:
+    Interpreter(const Interpreter&);
+    Interpreter& operator = (const Interpreter&);
+
+    malValuePtr apply(malValuePtr function, malValueVec& args);
+
+    template <class F, class R, class... Args>
+    void define(const String& name, const F& function,
+                R (F::*)(Args...) const) {
+        define(name, std::function<R(Args...)>(function));
+    }
+
+    malEnvPtr m_env;
+};
+
+#endif // INCLUDE_INTERPRETER_H
@@ -0,0 +1,144 @@
+#ifndef INCLUDE_NATIVE_H
+#define INCLUDE_NATIVE_H
+
+#include "Types.h"
+#include "Validation.h"
+
+#include <limits>
+#include <type_traits>
+
+// Converts between C++ and mal values, for calls from one to the other.
+// NativeValue<T>::toValue makes a mal value from a T, and fromValue makes a
+// T from a mal value, throwing if it's of the wrong type. T may be
+// malValuePtr itself, bool, any integer type, String, or a std::vector of
+// any of these; char pointers convert to mal only.
+template <class T, class Enable = void>
+struct NativeValue;
+
+template <>
+struct NativeValue<malValuePtr> {
+    static malValuePtr toValue(malValuePtr value) { return value; }
+    static malValuePtr fromValue(malValuePtr value) { return value; }
+};
+
+template <>
+struct NativeValue<bool> {
+    static malValuePtr toValue(bool value) { return mal::boolean(value); }
+    static bool fromValue(malValuePtr value) { return value->isTrue(); }
+};
+
+// Integers which don't fit in the type they convert to throw, rather than
+// wrap or lose their high bits.
+template <class T>
+struct NativeValue<T, typename std::enable_if<
+    std::is_integral<T>::value && !std::is_same<T, bool>::value>::type> {
+    static malValuePtr toValue(T value) {
+        MAL_CHECK(std::is_signed<T>::value ||
+                  ((uint64_t)value <=
+                   (uint64_t)std::numeric_limits<int64_t>::max()),
+                  "%llu is too large for a mal integer",
+                  (unsigned long long)value);
+        return mal::integer(value);
+    }
+    static T fromValue(malValuePtr value) {
+        typedef std::numeric_limits<T> Limits;
+        int64_t number = VALUE_CAST(malInteger, value)->value();
+        MAL_CHECK((number < 0) ? (number >= (int64_t)Limits::min())
+                               : ((uint64_t)number <= (uint64_t)Limits::max()),
+                  "%s is out of range", value->print(true).c_str());
+        return (T)number;
+    }
+};
+
+template <>
+struct NativeValue<String> {
+    static malValuePtr toValue(const String& value) {
+        return mal::string(value);
+    }
+    static String fromValue(malValuePtr value) {
+        return VALUE_CAST(malString, value)->value();
+    }
+};
+
+template <>
+struct NativeValue<const char*> {
+    static malValuePtr toValue(const char* value) {
+        return mal::string(value);
+    }
+};
+
+template <>
+struct NativeValue<char*> : NativeValue<const char*> { };
+
+// Vectors convert to mal vectors, and from any sequence or nil.
+template <class T>
+struct NativeValue<std::vector<T> > {
+    static malValuePtr toValue(const std::vector<T>& value) {
+        malValueVec* items = new malValueVec;
+        items->reserve(value.size());
+        for (auto& item : value) {
+            items->push_back(NativeValue<T>::toValue(item));
+        }
+        return mal::vector(items);
+    }
+    static std::vector<T> fromValue(malValuePtr value) {
+        std::vector<T> items;
+        for (malIterator it(value); !it.atEnd(); it.next()) {
+            items.push_back(NativeValue<T>::fromValue(it.value()));
+        }
+        return items;
+    }
+};
+
+// Nothing comes back from C++ functions as nil, and calls from C++ may
+// ignore their result.
+template <>
+struct NativeValue<void> {
+    static void fromValue(malValuePtr value) { }
+};
+
+// The type which converts values for an argument or result of type T.
+template <class T>
+struct NativeType {
+    typedef NativeValue<typename std::decay<T>::type> type;
+};
+
+// Wraps a C++ function as the function of a builtin, converting its
+// arguments from mal and its result back to mal.
+template <class R, class... Args>
+class NativeFunction {
+public:
+    NativeFunction(const std::function<R(Args...)>& function)
+    : m_function(function) { }
+
+    malValuePtr operator()(const String& name,
+                           malValueIter argsBegin,
+                           malValueIter argsEnd) const {
+        checkArgsIs(name.c_str(), sizeof...(Args),
+                    std::distance(argsBegin, argsEnd));
+        return invoke(argsBegin, typename Indices<sizeof...(Args)>::type(),
+                      static_cast<R*>(NULL));
+    }
+
+private:
+    // The indices 0 to N-1 as a parameter pack, to unpack the arguments.
+    template <int... I> struct Pack { };
+    template <int N, int... I> struct Indices : Indices<N-1, N-1, I...> { };
+    template <int... I> struct Indices<0, I...> { typedef Pack<I...> type; };
+
+    template <class T, int... I>
+    malValuePtr invoke(malValueIter args, Pack<I...>, T*) const {
+        return NativeType<R>::type::toValue(
+            m_function(NativeType<Args>::type::fromValue(args[I])...));
+    }
+
+    template <int... I>
+    malValuePtr invoke(malValueIter args, Pack<I...>, void*) const {
+        m_function(NativeType<Args>::type::fromValue(args[I])...);
+        return mal::nilValue();
+    }
+
+    std::function<R(Args...)> m_function;
+};
+
+#endif // INCLUDE_NATIVE_H
@@ -0,0 +1,287 @@
+#include "Profiler.h"
+#include "Tracer.h"
+#include "Types.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+
+MAL_THREAD_LOCAL bool Profiler::s_isEnabled = false;
+MAL_THREAD_LOCAL int  Profiler::s_clients = 0;
+MAL_THREAD_LOCAL int  Profiler::s_run = 0;
+
+namespace {
+
+struct Stats {
+    malValuePtr fn;     // keeps the function alive, so its address is unique
+    String      name;
+    int64_t     calls;
+    int64_t     inclusiveNs;
+    int64_t     exclusiveNs;
+    int         active; // calls in progress, so recursion isn't counted twice
+    bool        isTraced;
+};
+
+// A node in the tree of call stacks seen. Calls below MAX_LEVEL are counted
+// in the node at that level, so that the folded stacks of deep recursion
+// don't grow with the square of its depth, but trees can still be deep, so
+// they're walked with an explicit stack rather than recursively.
+struct Node {
+    typedef std::unordered_map<uintptr_t, Node*> Children;
+    enum { MAX_LEVEL = 256 };
+
+    Node(Node* parent, uintptr_t key, Stats* stats)
+    : parent(parent), key(key), stats(stats), selfNs(0)
+    , level(parent ? parent->level + 1 : 0) { }
+
+    Node*     parent;
+    uintptr_t key;
+    Stats*    stats;
+    int64_t   selfNs;
+    int       level;
+    Children  children;
+};
+
+struct Entry {
+    Node*   node;
+    Stats*  stats;      // the function called, which isn't the node's past
+                        // MAX_LEVEL
+    int64_t startNs;
+    int64_t childNs;
+    size_t  depth;
+    bool    isTail;
+};
+
+struct Profile {
+    Profile() : root(NULL, 0, NULL) { }
+
+    ~Profile() {
+        std::vector<Node*> pending;
+        for (auto it = root.children.begin(); it != root.children.end(); ++it) {
+            pending.push_back(it->second);
+        }
+        while (!pending.empty()) {
+            Node* node = pending.back();
+            pending.pop_back();
+            for (auto it = node->children.begin();
+                 it != node->children.end(); ++it) {
+                pending.push_back(it->second);
+            }
+            delete node;
+        }
+    }
+
+    std::unordered_map<uintptr_t, Stats> stats;
+    Node                                 root;
+    std::vector<Entry>                   entries;
+};
+
+}
+
+static MAL_THREAD_LOCAL Profile* s_profile = NULL;
+
+static String nameOf(const malValuePtr& fn, Profiler::Kind kind)
+{
+    String name;
+    if (const malBuiltIn* builtIn = DYNAMIC_CAST(malBuiltIn, fn)) {
+        name = builtIn->name();
+    }
+    else if (const malLambda* lambda = DYNAMIC_CAST(malLambda, fn)) {
+        name = lambda->name().empty() ? "anonymous" : lambda->name();
+    }
+    else {
+        name = fn->print(true);
+    }
+    return (kind == Profiler::MACRO) ? name + " (expansion)" : name;
+}
+
+// Replacing the profile drops the calls in progress, which Scopes notice
+// by the change of run.
+void Profiler::start(Client client)
+{
+    if ((client == PROFILING) || !s_profile) {
+        delete s_profile;
+        s_profile = new Profile;
+        s_run++;
+    }
+    s_clients |= client;
+    s_isEnabled = true;
+}
+
+void Profiler::stop(Client client)
+{
+    if (s_clients == client) {
+        leave(s_run, 0);
+        s_isEnabled = false;
+        s_run++;
+    }
+    s_clients &= ~client;
+}
+
+static Stats* statsFor(const malValuePtr& fn, Profiler::Kind kind,
+                       uintptr_t key)
+{
+    Stats& stats = s_profile->stats[key];
+    if (!stats.fn) {
+        stats.fn = fn;
+        stats.name = nameOf(fn, kind);
+        stats.isTraced = (kind == Profiler::CALL) && DYNAMIC_CAST(malLambda, fn);
+    }
+    return &stats;
+}
+
+void Profiler::enter(const malValuePtr& fn, Kind kind, size_t depth,
+                     bool isTail)
+{
+    // Functions are aligned, so the kind can go in the bottom bit of the key.
+    uintptr_t key = reinterpret_cast<uintptr_t>(fn.ptr()) | kind;
+    std::vector<Entry>& entries = s_profile->entries;
+    Node* node = entries.empty() ? &s_profile->root : entries.back().node;
+    Stats* stats;
+
+    // A function calling itself directly is counted in the caller's node,
+    // so that recursion doesn't make the tree as deep as the calls.
+    if (node->key == key) {
+        stats = node->stats;
+    }
+    else if (node->level == Node::MAX_LEVEL) {
+        stats = statsFor(fn, kind, key);
+    }
+    else {
+        Node*& child = node->children[key];
+        if (!child) {
+            child = new Node(node, key, statsFor(fn, kind, key));
+        }
+        node = child;
+        stats = node->stats;
+    }
+    stats->calls++;
+    stats->active++;
+    entries.push_back(Entry { node, stats, Tracer::nowNs(), 0, depth, isTail });
+}
+
+//  Ends the entries from index up, provided they belong to the current run.
+void Profiler::leave(int run, size_t index)
+{
+    if (run != s_run) {
+        return;
+    }
+    std::vector<Entry>& entries = s_profile->entries;
+    const int64_t now = Tracer::nowNs();
+    while (entries.size() > index) {
+        Entry& entry = entries.back();
+        const int64_t elapsed = now - entry.startNs;
+        const int64_t self = elapsed - entry.childNs;
+        Stats* stats = entry.stats;
+        stats->exclusiveNs += self;
+        if (--stats->active == 0) {
+            stats->inclusiveNs += elapsed;
+        }
+        entry.node->selfNs += self;
+        if ((s_clients & TRACING) && stats->isTraced &&
+            (elapsed >= Tracer::lambdaThresholdNs())) {
+            Tracer::record("lambda", stats->name, String(),
+                           entry.startNs, elapsed);
+        }
+        entries.pop_back();
+        if (!entries.empty()) {
+            entries.back().childNs += elapsed;
+        }
+    }
+}
+
+void Profiler::leaveTails(size_t depth)
+{
+    std::vector<Entry>& entries = s_profile->entries;
+    size_t index = entries.size();
+    while ((index > 0) && entries[index - 1].isTail &&
+           (entries[index - 1].depth >= depth)) {
+        index--;
+    }
+    leave(s_run, index);
+}
+
+size_t Profiler::entryCount()
+{
+    return s_profile->entries.size();
+}
+
+String Profiler::report()
+{
+    if (!s_profile) {
+        return String();
+    }
+
+    std::vector<const Stats*> sorted;
+    for (auto it = s_profile->stats.begin(); it != s_profile->stats.end(); ++it) {
+        sorted.push_back(&it->second);
+    }
+    std::sort(sorted.begin(), sorted.end(),
+        [](const Stats* lhs, const Stats* rhs) {
+            return lhs->exclusiveNs > rhs->exclusiveNs;
+        });
+
+    String out = STRF("%12s %14s %14s  %s\n",
+                      "calls", "inclusive ms", "exclusive ms", "function");
+    for (auto it = sorted.begin(); it != sorted.end(); ++it) {
+        const Stats* stats = *it;
+        out += STRF("%12lld %14.3f %14.3f  %s\n", (long long)stats->calls,
+                    stats->inclusiveNs / 1e6, stats->exclusiveNs / 1e6,
+                    stats->name.c_str());
+    }
+    return out;
+}
+
+// Walks the tree depth first, extending and trimming a single path as it
+// goes, and writes out each node with time of its own.
+static void writeFolded(const Node* root, std::ostream& out)
+{
+    struct Visit {
+        const Node*                    node;
+        Node::Children::const_iterator next;
+        size_t                         pathLength; // before the node's name
+    };
+    String path;
+    std::vector<Visit> visits;
+    visits.push_back(Visit { root, root->children.begin(), 0 });
+    while (!visits.empty()) {
+        Visit& visit = visits.back();
+        if (visit.next == visit.node->children.end()) {
+            path.resize(visit.pathLength);
+            visits.pop_back();
+            continue;
+        }
+        const Node* child = (visit.next++)->second;
+        const size_t pathLength = path.size();
+        String name = child->stats->name;
+        std::replace(name.begin(), name.end(), ';', ':');
+        std::replace(name.begin(), name.end(), ' ', '_');
+        if (!path.empty()) {
+            path += ';';
+        }
+        path += name;
+        if (child->selfNs >= 1000) {
+            out << path << ' ' << (long long)(child->selfNs / 1000) << '\n';
+        }
+        visits.push_back(Visit { child, child->children.begin(), pathLength });
+    }
+}
+
+String Profiler::foldedStacks()
+{
+    std::ostringstream out;
+    if (s_profile) {
+        writeFolded(&s_profile->root, out);
+    }
+    return out.str();
+}
+
+void Profiler::writeFoldedStacks(const String& filename)
+{
+    std::ofstream file(filename.c_str());
+    MAL_CHECK(!file.fail(), "Cannot open %s", filename.c_str());
+    if (s_profile) {
+        writeFolded(&s_profile->root, file);
+    }
+}
@@ -0,0 +1,103 @@
+#ifndef INCLUDE_PROFILER_H
+#define INCLUDE_PROFILER_H
+
+#include "MAL.h"
+
+#include <stdint.h>
+
+// Records how often each function is called, the time spent in it including
+// and excluding the functions it calls, and the time spent expanding each
+// macro. It keeps a shadow of the mal call stack, so that the results can
+// also be written out as folded stacks for flame graph tools.
+//
+// Calls which return before their caller continues, such as builtins, are
+// recorded with a Scope. Calls to lambdas which the evaluator makes by
+// jumping to their body are tail entries, which end when a value is returned
+// to a frame below the one they started at, or when a tail call replaces
+// them. Because of that, a lambda's inclusive time stops at its tail call.
+//
+// The Tracer uses the shadow stack too, to time lambda calls. The stack is
+// kept while either of them is running.
+//
+// In threaded builds, all of this state is per thread, so only the thread
+// which started the profiler is recorded.
+class Profiler {
+public:
+    enum Kind { CALL, MACRO };
+    enum Client { PROFILING = 1, TRACING = 2 };
+
+    static bool isEnabled() { return s_isEnabled; }
+
+    // Starting to profile clears the results of the previous run, which are
+    // otherwise kept after stopping.
+    static void start(Client client = PROFILING);
+    static void stop(Client client = PROFILING);
+
+    class Scope {
+    public:
+        Scope(const malValuePtr& fn, Kind kind = CALL)
+        : m_isActive(s_isEnabled), m_run(0), m_index(0) {
+            if (m_isActive) {
+                enter(fn, kind, 0, false);
+                m_run = s_run;
+                m_index = entryCount() - 1;
+            }
+        }
+
+        ~Scope() {
+            if (m_isActive) {
+                leave(m_run, m_index);
+            }
+        }
+
+    private:
+        bool   m_isActive;
+        int    m_run;
+        size_t m_index;
+    };
+
+    // A lambda call made at the given depth of the evaluator's frame stack.
+    static void enterTail(const malValuePtr& fn, size_t depth) {
+        if (s_isEnabled) {
+            returnTo(depth);
+            enter(fn, CALL, depth, true);
+        }
+    }
+
+    // A value has been returned with the frame stack at depth.
+    static void returnTo(size_t depth) {
+        if (s_isEnabled) {
+            leaveTails(depth);
+        }
+    }
+
+    // An exception has unwound the frame stack to depth.
+    static void unwindTo(size_t depth) {
+        if (s_isEnabled) {
+            leaveTails(depth + 1);
+        }
+    }
+
+    // A table of the functions profiled, sorted by exclusive time.
+    static String report();
+
+    // One line per call stack, naming its functions from the outermost in,
+    // followed by the exclusive time spent in it in microseconds. Calls a
+    // function makes directly to itself are counted as part of the caller,
+    // as are all calls more than 256 deep.
+    static String foldedStacks();
+    static void writeFoldedStacks(const String& filename);
+
+private:
+    static void enter(const malValuePtr& fn, Kind kind, size_t depth,
+                      bool isTail);
+    static void leave(int run, size_t index);
+    static void leaveTails(size_t depth);
+    static size_t entryCount();
+
+    static MAL_THREAD_LOCAL bool s_isEnabled;
+    static MAL_THREAD_LOCAL int  s_clients;
+    static MAL_THREAD_LOCAL int  s_run;
+};
+
+#endif // INCLUDE_PROFILER_H
@@ -2,25 +2,163 @@
 #define INCLUDE_REFCOUNTEDPTR_H
 
 #include "Debug.h"
+#include "Threads.h"
 
 #include <cstddef>
+#include <stdint.h>
+
+#ifndef MAL_THREADS
 
 class RefCounted {
 public:
-    RefCounted() : m_refCount(0) { }
+    RefCounted() : m_refCount(0) { s_allocations.add(1); }
     virtual ~RefCounted() { }
 
-    const RefCounted* acquire() const { m_refCount++; return this; }
-    int release() const { return --m_refCount; }
-    int refCount() const { return m_refCount; }
+    const RefCounted* acquire() const {
+        m_refCount++;
+        s_acquires.add(1);
+        return this;
+    }
+
+    // Returns true if that was the last reference, and the object should
+    // be deleted.
+    bool release() const { return --m_refCount == 0; }
+
+    // True if the caller holds the only reference, so no one else can see
+    // changes made to the object.
+    bool isUnique() const { return m_refCount == 1; }
+
+    static bool mergeQueued() { return false; }
+
+    // Deletes an object whose last reference has been released. Deleting an
+    // object releases the values it holds, so freeing a deeply nested value
+    // recurses once per level; past a depth, deletes are queued instead, and
+    // the outermost one works through the queue.
+    static void destroy(const RefCounted* object);
+
+    // The number of objects created so far.
+    static int64_t allocations() { return s_allocations.value(); }
+
+    // The number of references taken so far.
+    static int64_t acquires() { return s_acquires.value(); }
 
 private:
     RefCounted(const RefCounted&); // no copy ctor
     RefCounted& operator = (const RefCounted&); // no assignments
 
     mutable int m_refCount;
+
+    static StatCounter s_allocations;
+    static StatCounter s_acquires;
 };
 
+#else // MAL_THREADS
+
+// With threads, objects use biased reference counting, so that values may
+// be shared between threads without the thread which made them paying for
+// atomic operations, which is the common case.
+//
+// The thread which creates an object owns it, and counts its references in
+// a plain counter. Other threads count theirs in an atomic shared counter,
+// which also holds the MERGED and QUEUED flags. When the owner's count drops
+// to zero, it gives up ownership by merging the counts, after which all
+// threads use the shared counter.
+//
+// A reference taken by the owner may be dropped by another thread, taking
+// the shared count below zero. The object is then queued for its owner to
+// merge the counts at its next safe point, see mergeQueued(). Objects whose
+// owner has exited are merged straight away.
+class RefCounted {
+public:
+    RefCounted() : m_biased(0) {
+        const uint32_t thread = Thread::id();
+        const bool isOwned = (thread != Thread::EXITED);
+        m_owner.store(isOwned ? thread : 0, std::memory_order_relaxed);
+        m_shared.store(isOwned ? 0 : MERGED, std::memory_order_relaxed);
+        s_allocations.add(1);
+    }
+    virtual ~RefCounted() { }
+
+    const RefCounted* acquire() const {
+        if (isOwner()) {
+            m_biased++;
+        }
+        else {
+            m_shared.fetch_add(ONE, std::memory_order_relaxed);
+        }
+        s_acquires.add(1);
+        return this;
+    }
+
+    // Returns true if that was the last reference, and the object should
+    // be deleted.
+    bool release() const {
+        if (isOwner()) {
+            // If no other thread holds a reference, none can take one.
+            return (--m_biased == 0) &&
+                   ((m_shared.load(std::memory_order_acquire) == 0) ||
+                    disown());
+        }
+        return releaseShared();
+    }
+
+    // True if the caller holds the only reference, so no one else can see
+    // changes made to the object.
+    bool isUnique() const {
+        const int shared = m_shared.load(std::memory_order_acquire);
+        if (isOwner()) {
+            return m_biased + (shared >> SHIFT) == 1;
+        }
+        return (shared & MERGED) && ((shared >> SHIFT) == 1);
+    }
+
+    // Merges the counts of the objects which other threads have queued for
+    // this one, freeing those which are no longer referenced. Threads which
+    // share values call this now and then, when they hold no locks. Returns
+    // true if there were any.
+    static bool mergeQueued() {
+        return Thread::hasQueued() && mergeQueuedSlow();
+    }
+
+    // Deletes an object whose last reference has been released.
+    static void destroy(const RefCounted* object);
+
+    // The number of objects created so far.
+    static int64_t allocations() { return s_allocations.value(); }
+
+    // The number of references taken so far.
+    static int64_t acquires() { return s_acquires.value(); }
+
+private:
+    RefCounted(const RefCounted&); // no copy ctor
+    RefCounted& operator = (const RefCounted&); // no assignments
+
+    friend class Thread;
+
+    static const int MERGED = 1; // the owner has given up ownership
+    static const int QUEUED = 2; // waiting for the owner to merge
+    static const int SHIFT  = 2;
+    static const int ONE    = 1 << SHIFT;
+
+    bool isOwner() const {
+        return m_owner.load(std::memory_order_relaxed) == Thread::id();
+    }
+
+    bool disown() const;
+    bool releaseShared() const;
+    bool merge() const;
+    static bool mergeQueuedSlow();
+
+    mutable std::atomic<uint32_t> m_owner;  // 0 once merged
+    mutable int                   m_biased; // only touched by the owner
+    mutable std::atomic<int>      m_shared;
+
+    static StatCounter s_allocations;
+    static StatCounter s_acquires;
+};
+
+#endif // MAL_THREADS
+
 template<class T>
 class RefCountedPtr {
 public:
@@ -66,12 +204,98 @@ private:
     }
 
     void release() {
-        if ((m_object != NULL) && (m_object->release() == 0)) {
-            delete m_object;
+        if ((m_object != NULL) && m_object->release()) {
+            RefCounted::destroy(m_object);
         }
     }
 
     T* m_object;
 };
 
+// A RefCountedPtr which several threads may read and replace at once, like
+// the value of an atom. Replacing it only succeeds if it still holds the
+// object expected, so that a thread can tell if another got in first.
+template<class T>
+class AtomicRefCountedPtr {
+public:
+#ifdef MAL_THREADS
+    AtomicRefCountedPtr(const RefCountedPtr<T>& value)
+    : m_object(value.ptr()) {
+        if (value) {
+            value->acquire();
+        }
+    }
+
+    ~AtomicRefCountedPtr() {
+        T* object = m_object.load(std::memory_order_relaxed);
+        if ((object != NULL) && object->release()) {
+            RefCounted::destroy(object);
+        }
+    }
+
+    RefCountedPtr<T> load() const {
+        RefCountedPtr<T> value(Hazard::protect(m_object));
+        Hazard::clear();
+        return value;
+    }
+
+    bool compareAndSet(const RefCountedPtr<T>& expected,
+                       const RefCountedPtr<T>& value) {
+        T* old = expected.ptr();
+        if (value) {
+            value->acquire();
+        }
+        if (m_object.compare_exchange_strong(old, value.ptr())) {
+            retire(old);
+            return true;
+        }
+        if (value) {
+            value->release(); // never the last, the caller holds one
+        }
+        return false;
+    }
+
+    void store(const RefCountedPtr<T>& value) {
+        if (value) {
+            value->acquire();
+        }
+        retire(m_object.exchange(value.ptr()));
+    }
+
+private:
+    AtomicRefCountedPtr(const AtomicRefCountedPtr&);
+    AtomicRefCountedPtr& operator = (const AtomicRefCountedPtr&);
+
+    // Another thread may be taking a reference to it.
+    static void retire(T* object) {
+        if (object != NULL) {
+            Hazard::retire(object);
+        }
+    }
+
+    std::atomic<T*> m_object;
+#else
+    AtomicRefCountedPtr(const RefCountedPtr<T>& value) : m_object(value) { }
+
+    RefCountedPtr<T> load() const { return m_object; }
+
+    bool compareAndSet(const RefCountedPtr<T>& expected,
+                       const RefCountedPtr<T>& value) {
+        if (m_object != expected) {
+            return false;
+        }
+        m_object = value;
+        return true;
+    }
+
+    void store(const RefCountedPtr<T>& value) { m_object = value; }
+
+private:
+    AtomicRefCountedPtr(const AtomicRefCountedPtr&);
+    AtomicRefCountedPtr& operator = (const AtomicRefCountedPtr&);
+
+    RefCountedPtr<T> m_object;
+#endif
+};
+
 #endif // INCLUDE_REFCOUNTEDPTR_H
@@ -0,0 +1,92 @@
+#include "RuntimeStats.h"
+#include "Environment.h"
+#include "Types.h"
+
+StatCounter RuntimeStats::s_atomRetries;
+StatCounter RuntimeStats::s_vectorBytes;
+
+namespace {
+
+struct ClassCounts {
+    const char* name;
+    int64_t     live;
+    int64_t     total;
+};
+
+}
+
+#define CLASS_COUNTS(name, Class) \
+    { name, Counted<Class>::live(), Counted<Class>::total() }
+
+static std::vector<ClassCounts> classCounts()
+{
+    return {
+        CLASS_COUNTS("atom",        malAtom),
+        CLASS_COUNTS("builtin",     malBuiltIn),
+        CLASS_COUNTS("composition", malComposition),
+        CLASS_COUNTS("constant",    malConstant),
+        CLASS_COUNTS("env",         malEnv),
+        CLASS_COUNTS("future",      malFuture),
+        CLASS_COUNTS("hash-map",    malHash),
+        CLASS_COUNTS("int-array",   malIntArray),
+        CLASS_COUNTS("integer",     malInteger),
+        CLASS_COUNTS("keyword",     malKeyword),
+        CLASS_COUNTS("lambda",      malLambda),
+        CLASS_COUNTS("lazy-seq",    malLazySeq),
+        CLASS_COUNTS("list",        malList),
+        CLASS_COUNTS("memoized",    malMemoized),
+        CLASS_COUNTS("quasiquote",  malQuasiquote),
+        CLASS_COUNTS("string",      malString),
+        CLASS_COUNTS("symbol",      malSymbol),
+        CLASS_COUNTS("transducer",  malTransducer),
+        CLASS_COUNTS("vector",      malVector),
+    };
+}
+
+malValuePtr RuntimeStats::asHash()
+{
+    const malValuePtr live = mal::keyword(":live");
+    const malValuePtr total = mal::keyword(":total");
+
+    std::vector<ClassCounts> classes = classCounts();
+    malValueVec objects;
+    for (auto it = classes.begin(); it != classes.end(); ++it) {
+        malValueVec counts = {
+            live,   mal::integer(it->live),
+            total,  mal::integer(it->total),
+        };
+        objects.push_back(mal::keyword(String(":") + it->name));
+        objects.push_back(mal::hash(counts.begin(), counts.end(), true));
+    }
+
+    malValueVec stats = {
+        mal::keyword(":objects"),
+            mal::hash(objects.begin(), objects.end(), true),
+        mal::keyword(":allocations"),
+            mal::integer(RefCounted::allocations()),
+        mal::keyword(":atom-retries"),
+            mal::integer(atomRetries()),
+        mal::keyword(":refcount-increments"),
+            mal::integer(RefCounted::acquires()),
+        mal::keyword(":vector-bytes"),
+            mal::integer(vectorBytes()),
+    };
+    return mal::hash(stats.begin(), stats.end(), true);
+}
+
+String RuntimeStats::report()
+{
+    String out = STRF("%-12s %12s %12s\n", "objects", "live", "total");
+    std::vector<ClassCounts> classes = classCounts();
+    for (auto it = classes.begin(); it != classes.end(); ++it) {
+        out += STRF("%-12s %12lld %12lld\n",
+                    it->name, (long long)it->live, (long long)it->total);
+    }
+    out += STRF("allocations:         %lld\n",
+                (long long)RefCounted::allocations());
+    out += STRF("refcount increments: %lld\n",
+                (long long)RefCounted::acquires());
+    out += STRF("atom retries:        %lld\n", (long long)atomRetries());
+    out += STRF("vector bytes:        %lld\n", (long long)vectorBytes());
+    return out;
+}
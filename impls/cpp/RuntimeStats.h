@@ -0,0 +1,70 @@
+#ifndef INCLUDE_RUNTIMESTATS_H
+#define INCLUDE_RUNTIMESTATS_H
+
+#include "MAL.h"
+#include "Threads.h"
+
+#include <stdint.h>
+
+// Counts the objects of class T which are alive, and which have ever been
+// created. The COUNTED macro gives a class an operator new and delete which
+// keep count, so this costs an increment when an object is allocated and
+// another when it's freed. Counting from a base class instead would give
+// each class a second base, which makes dynamic_cast much slower.
+template <class T>
+class Counted {
+public:
+    static int64_t live()  { return s_live.value(); }
+    static int64_t total() { return s_total.value(); }
+
+    static void add(int delta) {
+        s_live.add(delta);
+        if (delta > 0) {
+            s_total.add(delta);
+        }
+    }
+
+private:
+    static StatCounter s_live;
+    static StatCounter s_total;
+};
+
+template <class T> StatCounter Counted<T>::s_live;
+template <class T> StatCounter Counted<T>::s_total;
+
+// The operators are forced inline so that GCC sees which allocation each
+// delete pairs up with, and doesn't warn about mismatches.
+#define COUNTED(Type) \
+    __attribute__((always_inline)) \
+    static void* operator new(size_t size) { \
+        Counted<Type>::add(1); \
+        return ::operator new(size); \
+    } \
+    __attribute__((always_inline)) \
+    static void operator delete(void* object) { \
+        Counted<Type>::add(-1); \
+        ::operator delete(object); \
+    }
+
+class RuntimeStats {
+public:
+    // The times swap! and compare-and-set! lost a race to change an atom.
+    static void addAtomRetries(int64_t count) { s_atomRetries.add(count); }
+    static int64_t atomRetries() { return s_atomRetries.value(); }
+
+    // The memory held by the item vectors of lists and vectors.
+    static void addVectorBytes(int64_t bytes) { s_vectorBytes.add(bytes); }
+    static int64_t vectorBytes() { return s_vectorBytes.value(); }
+
+    // All the counters, as a hash-map for (runtime-stats).
+    static malValuePtr asHash();
+
+    // All the counters, as a table.
+    static String report();
+
+private:
+    static StatCounter s_atomRetries;
+    static StatCounter s_vectorBytes;
+};
+
+#endif // INCLUDE_RUNTIMESTATS_H
@@ -0,0 +1,309 @@
+#include "Server.h"
+#include "Environment.h"
+#include "Interpreter.h"
+#include "ThreadPool.h"
+#include "Threads.h"
+#include "Types.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <deque>
+#include <map>
+
+struct Connection {
+    Connection(int fd, malEnvPtr env)
+    : fd(fd), env(env), isBusy(false), isClosing(false) { }
+
+    int       fd;
+    malEnvPtr env;
+    String    input;    // read, but not yet a whole line
+    String    output;   // responses not yet written
+    std::deque<String> requests;
+    bool      isBusy;   // a request is running on the pool
+    bool      isClosing; // the client has finished sending
+};
+
+typedef std::map<int, Connection> ConnectionMap;
+
+// Responses from the pool, waiting for the event loop to pick them up. The
+// pool writes to the wake pipe to have poll() return.
+struct Response {
+    int    connection;
+    String text;
+};
+
+static SpinLock               s_responseLock;
+static std::vector<Response>  s_responses;
+static int                    s_wakePipe[2] = { -1, -1 };
+static volatile sig_atomic_t  s_isStopping = 0;
+
+static void wake()
+{
+    char byte = 0;
+    while ((write(s_wakePipe[1], &byte, 1) < 0) && (errno == EINTR)) { }
+}
+
+static void stop(int signal)
+{
+    s_isStopping = 1;
+    wake();
+}
+
+static malValuePtr handleRequest(const String& line, malEnvPtr env)
+{
+    malValuePtr request = readStr(line);
+    const malSequence* items = DYNAMIC_CAST(malSequence, request);
+    MAL_CHECK(items && !items->isEmpty(),
+              "%s is not a request", request->print(true).c_str());
+    String kind = items->item(0)->print(true);
+    if ((kind == ":eval") && (items->count() == 2)) {
+        return EVAL(items->item(1), env);
+    }
+    if ((kind == ":call") && (items->count() >= 2)) {
+        malValuePtr name = items->item(1);
+        const malStringBase* symbol = DYNAMIC_CAST(malStringBase, name);
+        MAL_CHECK(symbol, "%s is not a function name",
+                  name->print(true).c_str());
+        return APPLY(env->get(symbol->value()),
+                     items->begin() + 2, items->end());
+    }
+    MAL_FAIL("%s is not a request", request->print(true).c_str());
+}
+
+static String respond(const String& line, malEnvPtr env)
+{
+    try {
+        return "[:ok " + handleRequest(line, env)->print(true) + "]\n";
+    }
+    catch (malEmptyInputException&) {
+        return "[:error \"empty request\"]\n";
+    }
+    catch (String& error) {
+        return "[:error " + mal::string(error)->print(true) + "]\n";
+    }
+    catch (malValuePtr& error) {
+        return "[:error " + error->print(true) + "]\n";
+    }
+}
+
+static void startRequest(int id, Connection& connection)
+{
+    if (connection.isBusy || connection.requests.empty()) {
+        return;
+    }
+    connection.isBusy = true;
+    String line = connection.requests.front();
+    connection.requests.pop_front();
+    malEnvPtr env = connection.env;
+    ThreadPool::submit([id, line, env]() {
+        // eval and load-file evaluate in the current environment, so they
+        // too see only what this connection has defined.
+        Interpreter::Scope scope(env);
+        Response response = { id, respond(line, env) };
+        {
+            LockGuard<SpinLock> lock(s_responseLock);
+            s_responses.push_back(response);
+        }
+        wake();
+    });
+}
+
+// Reads what the client has sent, and queues any whole lines. Returns false
+// once the client has finished sending.
+static bool readRequests(int id, Connection& connection)
+{
+    char buffer[4096];
+    ssize_t length = read(connection.fd, buffer, sizeof(buffer));
+    if (length < 0) {
+        return (errno == EAGAIN) || (errno == EINTR);
+    }
+    if (length == 0) {
+        return false;
+    }
+    connection.input.append(buffer, length);
+    size_t start = 0;
+    size_t end;
+    while ((end = connection.input.find('\n', start)) != String::npos) {
+        String line = connection.input.substr(start, end - start);
+        if (line.find_first_not_of(" \t\r") != String::npos) {
+            connection.requests.push_back(line);
+        }
+        start = end + 1;
+    }
+    connection.input.erase(0, start);
+    startRequest(id, connection);
+    return true;
+}
+
+// Writes what it can of the waiting responses. Returns false if the client
+// has gone.
+static bool writeResponses(Connection& connection)
+{
+    while (!connection.output.empty()) {
+        ssize_t length = write(connection.fd, connection.output.data(),
+                               connection.output.size());
+        if (length < 0) {
+            return (errno == EAGAIN) || (errno == EINTR);
+        }
+        connection.output.erase(0, length);
+    }
+    return true;
+}
+
+static void takeResponses(ConnectionMap& connections)
+{
+    char buffer[64];
+    while (read(s_wakePipe[0], buffer, sizeof(buffer)) > 0) { }
+
+    std::vector<Response> responses;
+    {
+        LockGuard<SpinLock> lock(s_responseLock);
+        responses.swap(s_responses);
+    }
+    for (auto& response : responses) {
+        auto it = connections.find(response.connection);
+        if (it != connections.end()) {
+            Connection& connection = it->second;
+            connection.output += response.text;
+            connection.isBusy = false;
+            startRequest(it->first, connection);
+        }
+    }
+}
+
+static void setNonBlocking(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+static int listenOn(const String& path)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    MAL_CHECK(path.size() < sizeof(address.sun_path),
+              "%s is too long for a socket path", path.c_str());
+    strcpy(address.sun_path, path.c_str());
+
+    // Only a socket, left by a server which didn't stop cleanly, may be
+    // replaced. Anything else at the path is left alone.
+    struct stat status;
+    if (lstat(path.c_str(), &status) == 0) {
+        MAL_CHECK(S_ISSOCK(status.st_mode),
+                  "%s is not a socket", path.c_str());
+        unlink(path.c_str());
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    MAL_CHECK(fd >= 0, "socket: %s", strerror(errno));
+    if ((bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0) ||
+        (listen(fd, SOMAXCONN) < 0)) {
+        String error = strerror(errno);
+        close(fd);
+        MAL_FAIL("%s: %s", path.c_str(), error.c_str());
+    }
+    setNonBlocking(fd);
+    return fd;
+}
+
+void Server::serve(Interpreter& interpreter, const String& path)
+{
+    Interpreter::Scope scope(interpreter.env());
+    int listener = listenOn(path);
+    MAL_CHECK(pipe(s_wakePipe) == 0, "pipe: %s", strerror(errno));
+    setNonBlocking(s_wakePipe[0]);
+    setNonBlocking(s_wakePipe[1]);
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+
+    ConnectionMap connections;
+    int nextId = 0;
+    std::vector<struct pollfd> fds;
+    std::vector<int> ids;
+    while (!s_isStopping) {
+        // This thread made the connections' environments, so it frees
+        // those which requests on the pool have dropped.
+        RefCounted::mergeQueued();
+        fds.clear();
+        ids.clear();
+        struct pollfd wakeFd = { s_wakePipe[0], POLLIN, 0 };
+        struct pollfd listenFd = { listener, POLLIN, 0 };
+        fds.push_back(wakeFd);
+        fds.push_back(listenFd);
+        for (auto& it : connections) {
+            Connection& connection = it.second;
+            short events = connection.isClosing ? 0 : POLLIN;
+            if (!connection.output.empty()) {
+                events |= POLLOUT;
+            }
+            // Closed clients would wake poll() until their requests finish.
+            struct pollfd fd = { events ? connection.fd : -1, events, 0 };
+            fds.push_back(fd);
+            ids.push_back(it.first);
+        }
+
+        // Builds without threads have no workers, so run the requests
+        // here, between waits.
+        if (ThreadPool::workerCount() == 0) {
+            while (ThreadPool::runOne()) { }
+        }
+        if (poll(&fds[0], fds.size(), -1) < 0) {
+            MAL_CHECK(errno == EINTR, "poll: %s", strerror(errno));
+            continue;
+        }
+
+        if (fds[0].revents) {
+            takeResponses(connections);
+        }
+        if (fds[1].revents & POLLIN) {
+            int fd;
+            while ((fd = accept(listener, NULL, NULL)) >= 0) {
+                setNonBlocking(fd);
+                malEnvPtr env(new malEnv(interpreter.env()));
+                connections.insert(std::make_pair(nextId++,
+                                                  Connection(fd, env)));
+            }
+        }
+        for (size_t i = 2; i < fds.size(); i++) {
+            auto it = connections.find(ids[i - 2]);
+            Connection& connection = it->second;
+            bool isOpen = true;
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                if (!connection.isClosing &&
+                    !readRequests(it->first, connection)) {
+                    connection.isClosing = true;
+                }
+            }
+            if (fds[i].revents & POLLOUT) {
+                isOpen = writeResponses(connection);
+            }
+            // Once the client has finished sending, it has what it asked
+            // for once the requests have all run and been written out.
+            if (!isOpen || (connection.isClosing && !connection.isBusy &&
+                            connection.requests.empty() &&
+                            connection.output.empty())) {
+                close(connection.fd);
+                connection.env->clear(); // to free what it defined
+                connections.erase(it);
+            }
+        }
+    }
+
+    for (auto& it : connections) {
+        close(it.second.fd);
+        it.second.env->clear();
+    }
+    close(listener);
+    unlink(path.c_str());
+    // The wake pipe stays open, for requests still running on the pool.
+}
@@ -0,0 +1,35 @@
+#ifndef INCLUDE_SERVER_H
+#define INCLUDE_SERVER_H
+
+#include "MAL.h"
+
+class Interpreter;
+
+// Serves an interpreter on a Unix domain socket, so that drivers which run
+// many small programs can keep one warm process instead of starting one,
+// and loading their libraries, for each.
+//
+// Requests and responses are a line each. A request is one of
+//
+//     [:eval form]          evaluates form
+//     [:call name arg ...]  calls the function name, with arguments which
+//                           aren't evaluated
+//
+// and its response is [:ok value] or [:error value], printed readably.
+// Each connection has an environment of its own, inside the interpreter's
+// root one, so it sees what was loaded before the server started but not
+// what other connections define, whether with def! or through eval and
+// load-file.
+//
+// One thread runs an event loop over the connections, and hands requests
+// to the thread pool, so in THREADS=1 builds requests from different
+// connections run at once. Each connection's requests run in turn.
+class Server {
+public:
+    // Serves until SIGINT or SIGTERM, then removes the socket. Throws if
+    // the socket can't be made, or if something other than a socket is
+    // already at path; a socket there is replaced.
+    static void serve(Interpreter& interpreter, const String& path);
+};
+
+#endif // INCLUDE_SERVER_H
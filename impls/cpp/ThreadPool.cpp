@@ -0,0 +1,295 @@
+#include "ThreadPool.h"
+#include "Interpreter.h"
+#include "RefCountedPtr.h"
+#include "Tracer.h"
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+#ifdef MAL_THREADS
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#endif
+
+namespace {
+
+struct Queue {
+    SpinLock                     lock;
+    std::deque<ThreadPool::Task> tasks;
+};
+
+// Queue 0 holds the tasks submitted by threads outside the pool, and the
+// rest belong to the workers. The pool is never freed, as workers may still
+// be running when the program exits.
+struct Pool {
+    Pool(int workerCount) : queues(workerCount + 1) { }
+
+    std::vector<Queue> queues;
+#ifdef MAL_THREADS
+    std::mutex              sleepLock;
+    std::condition_variable wake;
+    int                     pending; // tasks queued, guarded by sleepLock
+#endif
+};
+
+}
+
+static Atomic<Pool*> s_pool(NULL);
+
+static MAL_THREAD_LOCAL int t_worker = 0; // this thread's queue
+
+// Tasks evaluate in the interpreter which queued them, whichever thread
+// runs them.
+static ThreadPool::Task inCurrentInterpreter(const ThreadPool::Task& task)
+{
+    malEnvPtr env = Interpreter::currentEnv();
+    return [env, task]() {
+        Interpreter::Scope scope(env);
+        task();
+    };
+}
+
+static bool popFront(Queue& queue, ThreadPool::Task& task)
+{
+    LockGuard<SpinLock> lock(queue.lock);
+    if (queue.tasks.empty()) {
+        return false;
+    }
+    task.swap(queue.tasks.front());
+    queue.tasks.pop_front();
+    return true;
+}
+
+static bool popBack(Queue& queue, ThreadPool::Task& task)
+{
+    LockGuard<SpinLock> lock(queue.lock);
+    if (queue.tasks.empty()) {
+        return false;
+    }
+    task.swap(queue.tasks.back());
+    queue.tasks.pop_back();
+    return true;
+}
+
+// A worker's own tasks newest first, as their data is most likely to still
+// be in its cache, then the oldest of everyone else's.
+static bool take(Pool* pool, ThreadPool::Task& task)
+{
+    const int self = t_worker;
+    const int count = pool->queues.size();
+    bool isTaken = (self > 0) && popBack(pool->queues[self], task);
+    for (int i = 0; !isTaken && (i < count); i++) {
+        const int victim = (self + i) % count;
+        isTaken = (victim != self || self == 0) &&
+                  popFront(pool->queues[victim], task);
+    }
+#ifdef MAL_THREADS
+    if (isTaken) {
+        std::lock_guard<std::mutex> lock(pool->sleepLock);
+        pool->pending--;
+    }
+#endif
+    return isTaken;
+}
+
+#ifdef MAL_THREADS
+
+static void work(Pool* pool, int self)
+{
+    t_worker = self;
+    ThreadPool::Task task;
+    for (;;) {
+        if (take(pool, task)) {
+            task();
+            task = nullptr;
+            RefCounted::mergeQueued();
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(pool->sleepLock);
+        pool->wake.wait(lock, [pool]() { return pool->pending > 0; });
+    }
+}
+
+static std::once_flag s_poolStarted;
+
+static Pool* startPool()
+{
+    std::call_once(s_poolStarted, []() {
+        const int workerCount =
+            std::max(1u, std::thread::hardware_concurrency());
+        Pool* pool = new Pool(workerCount);
+        pool->pending = 0;
+        for (int i = 1; i <= workerCount; i++) {
+            std::thread(work, pool, i).detach();
+        }
+        s_pool = pool;
+    });
+    return s_pool;
+}
+
+void ThreadPool::submit(const Task& task)
+{
+    Pool* pool = startPool();
+    Queue& queue = pool->queues[t_worker];
+    {
+        LockGuard<SpinLock> lock(queue.lock);
+        queue.tasks.push_back(inCurrentInterpreter(task));
+    }
+    {
+        std::lock_guard<std::mutex> lock(pool->sleepLock);
+        pool->pending++;
+    }
+    pool->wake.notify_one();
+}
+
+bool ThreadPool::runOne()
+{
+    Pool* pool = s_pool;
+    Task task;
+    if (!pool || !take(pool, task)) {
+        return false;
+    }
+    task();
+    return true;
+}
+
+int ThreadPool::workerCount()
+{
+    return startPool()->queues.size() - 1;
+}
+
+namespace {
+
+// Work in parallelFor is timed on the calling thread until it has taken
+// SAMPLE_NS, and is only split if what's left would take over SPLIT_NS.
+// Chunks are sized to take at least CHUNK_NS.
+const int64_t SAMPLE_NS = 20000;
+const int64_t SPLIT_NS  = 200000;
+const int64_t CHUNK_NS  = 50000;
+
+// The state of a parallelFor. It's shared with the tasks which help with
+// it, as they may not start until it has returned.
+struct Loop {
+    const ThreadPool::Body* body;
+    int                     count;
+    int                     minChunk;
+    int                     threadCount;
+    Atomic<int>             next;     // the first item not yet handed out
+    Atomic<int>             finished; // items run, or skipped after an error
+    Atomic<bool>            isFailed;
+    std::mutex              errorLock;
+    std::exception_ptr      error;
+};
+
+}
+
+static void runChunks(Loop& loop)
+{
+    int begin = loop.next.load(std::memory_order_relaxed);
+    while (begin < loop.count) {
+        const int left = loop.count - begin;
+        const int size = std::max(loop.minChunk, left / (2 * loop.threadCount));
+        const int end = begin + std::min(size, left);
+        if (!loop.next.compare_exchange_weak(begin, end,
+                                             std::memory_order_relaxed)) {
+            continue;
+        }
+        if (!loop.isFailed.load(std::memory_order_relaxed)) {
+            try {
+                (*loop.body)(begin, end);
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> lock(loop.errorLock);
+                if (!loop.error) {
+                    loop.error = std::current_exception();
+                }
+                loop.isFailed = true;
+            }
+        }
+        loop.finished.fetch_add(end - begin, std::memory_order_release);
+        begin = end;
+    }
+}
+
+void ThreadPool::parallelFor(int count, const Body& body)
+{
+    // Time doubling ranges of the first items on this thread.
+    const int64_t startNs = Tracer::nowNs();
+    int64_t elapsedNs = 0;
+    int done = 0;
+    for (int size = 1; (done < count) && (elapsedNs < SAMPLE_NS); size *= 2) {
+        const int end = done + std::min(size, count - done);
+        body(done, end);
+        done = end;
+        elapsedNs = Tracer::nowNs() - startNs;
+    }
+    const int left = count - done;
+    if (left == 0) {
+        return;
+    }
+    const int64_t itemNs = std::max<int64_t>(1, elapsedNs / done);
+    if (left * itemNs < SPLIT_NS) {
+        body(done, count);
+        return;
+    }
+
+    std::shared_ptr<Loop> loop = std::make_shared<Loop>();
+    loop->body = &body;
+    loop->count = count;
+    loop->minChunk = std::max<int64_t>(1, CHUNK_NS / itemNs);
+    loop->threadCount = workerCount() + 1;
+    loop->next = done;
+    loop->finished = done;
+    loop->isFailed = false;
+
+    const int chunkCount = (left + loop->minChunk - 1) / loop->minChunk;
+    const int helperCount = std::min(workerCount(), chunkCount - 1);
+    for (int i = 0; i < helperCount; i++) {
+        submit([loop]() { runChunks(*loop); });
+    }
+    runChunks(*loop);
+    while (loop->finished.load(std::memory_order_acquire) < count) {
+        if (!runOne()) {
+            std::this_thread::yield();
+        }
+    }
+    if (loop->error) {
+        std::rethrow_exception(loop->error);
+    }
+}
+
+#else // MAL_THREADS
+
+void ThreadPool::submit(const Task& task)
+{
+    if (!s_pool) {
+        s_pool = new Pool(0);
+    }
+    s_pool->queues[0].tasks.push_back(inCurrentInterpreter(task));
+}
+
+bool ThreadPool::runOne()
+{
+    Task task;
+    if (!s_pool || !take(s_pool, task)) {
+        return false;
+    }
+    task();
+    return true;
+}
+
+int ThreadPool::workerCount()
+{
+    return 0;
+}
+
+void ThreadPool::parallelFor(int count, const Body& body)
+{
+    if (count > 0) {
+        body(0, count);
+    }
+}
+
+#endif // MAL_THREADS
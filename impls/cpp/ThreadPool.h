@@ -0,0 +1,42 @@
+#ifndef INCLUDE_THREADPOOL_H
+#define INCLUDE_THREADPOOL_H
+
+#include <functional>
+
+// Runs tasks, such as the bodies of futures, on a pool of worker threads,
+// one per hardware thread. Each worker has a queue of its own, which it
+// takes the tasks it queues itself from newest first, and when that's empty
+// it takes tasks queued by other threads, or steals the oldest ones from
+// other workers.
+//
+// A thread which is waiting for a task's result should help with the queued
+// tasks meanwhile, with runOne(). That keeps workers which wait for tasks
+// they've queued themselves from deadlocking the pool. Builds without
+// MAL_THREADS have no workers, so tasks only run when a thread helps.
+class ThreadPool {
+public:
+    typedef std::function<void()> Task;
+
+    // Tasks must not throw.
+    static void submit(const Task& task);
+
+    // Runs one queued task on this thread. Returns false if there were
+    // none.
+    static bool runOne();
+
+    // The number of worker threads, which are started by the first submit.
+    static int workerCount();
+
+    typedef std::function<void(int begin, int end)> Body;
+
+    // Calls body over consecutive ranges of [0, count), on the workers and
+    // this thread, and returns once all the calls have. The first items are
+    // timed on this thread, to size the chunks handed out so that each is
+    // worth the cost of passing to another thread; work too quick to be
+    // worth splitting at all runs on this thread alone. Chunks shrink as
+    // the work runs out, to keep the threads finishing together. Rethrows
+    // the first exception body throws, once the calls in flight return.
+    static void parallelFor(int count, const Body& body);
+};
+
+#endif // INCLUDE_THREADPOOL_H
@@ -0,0 +1,342 @@
+#include "Threads.h"
+#include "RefCountedPtr.h"
+#include "Validation.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef MAL_THREADS
+
+static const size_t STRIPE_COUNT = 64;
+
+static SpinLock s_stripes[STRIPE_COUNT];
+
+SpinLock& lockFor(const void* object)
+{
+    // Objects are at least 16 byte aligned, so the low bits say nothing.
+    return s_stripes[((uintptr_t)object >> 4) % STRIPE_COUNT];
+}
+
+// Objects are counted from static constructors onwards, so all of this
+// must be constant initialised.
+namespace {
+
+struct ThreadCounts {
+    std::atomic<int64_t> counts[StatCounter::CAPACITY];
+    ThreadCounts*        next;
+};
+
+}
+
+static std::mutex    s_countersLock;
+static int           s_counterCount = 0;
+static ThreadCounts* s_threadCounts = NULL; // never freed, threads may exit
+
+int StatCounter::assignIndex()
+{
+    std::lock_guard<std::mutex> lock(s_countersLock);
+    int index = m_index.load(std::memory_order_relaxed);
+    if (index < 0) {
+        if (s_counterCount == CAPACITY) {
+            // Counters are static, so this can only be a build problem.
+            fprintf(stderr, "Too many StatCounters, raise CAPACITY\n");
+            abort();
+        }
+        index = s_counterCount++;
+        m_index.store(index, std::memory_order_relaxed);
+    }
+    return index;
+}
+
+std::atomic<int64_t>* StatCounter::newThreadCounts()
+{
+    ThreadCounts* thread = new ThreadCounts;
+    for (int i = 0; i < CAPACITY; i++) {
+        thread->counts[i].store(0, std::memory_order_relaxed);
+    }
+    std::lock_guard<std::mutex> lock(s_countersLock);
+    thread->next = s_threadCounts;
+    s_threadCounts = thread;
+    return thread->counts;
+}
+
+int64_t StatCounter::value() const
+{
+    int index = m_index.load(std::memory_order_relaxed);
+    if (index < 0) {
+        return 0;
+    }
+    std::lock_guard<std::mutex> lock(s_countersLock);
+    int64_t total = 0;
+    for (ThreadCounts* thread = s_threadCounts; thread; thread = thread->next) {
+        total += thread->counts[index].load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+// The most threads which may use the interpreter at once.
+static const uint32_t MAX_THREADS = 1 << 16;
+
+namespace {
+
+// Objects which an exited thread still owns keep its id, so a thread which
+// is given the id takes over their counts, as if it had made them. Records
+// are kept with their ids, and reused with them.
+struct ThreadRecord {
+    std::mutex                     lock;
+    bool                           isAlive;
+    std::vector<const RefCounted*> queue;
+    std::atomic<bool>*             hasQueued;
+    uint32_t                       nextFree; // while on the free list
+};
+
+}
+
+static std::mutex                 s_threadsLock;
+static uint32_t                   s_threadCount = 0;
+static uint32_t                   s_freeId = 0; // the last thread to exit
+static std::atomic<ThreadRecord*> s_threads[MAX_THREADS];
+
+struct ThreadExit {
+    ~ThreadExit() { Thread::detach(); }
+};
+
+uint32_t Thread::attach()
+{
+    uint32_t id;
+    ThreadRecord* record;
+    {
+        std::lock_guard<std::mutex> lock(s_threadsLock);
+        if (s_freeId != 0) {
+            id = s_freeId;
+            record = s_threads[id].load(std::memory_order_relaxed);
+            s_freeId = record->nextFree;
+        }
+        else {
+            MAL_CHECK(s_threadCount < MAX_THREADS - 1,
+                      "Too many threads, at most %u may use the interpreter "
+                      "at once", MAX_THREADS - 1);
+            id = ++s_threadCount;
+            record = new ThreadRecord;
+            s_threads[id].store(record, std::memory_order_release);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(record->lock);
+        record->isAlive = true;
+        record->hasQueued = &queuedFlag();
+    }
+    idSlot() = id;
+    // Constructed once per thread, so that exiting threads detach.
+    static thread_local ThreadExit threadExit;
+    (void)threadExit;
+    return id;
+}
+
+void Thread::detach()
+{
+    // From here on, this thread's references are counted as if it were any
+    // other, and its objects are merged by whichever thread next queues them.
+    const uint32_t id = idSlot();
+    ThreadRecord* record = s_threads[id].load(std::memory_order_acquire);
+    std::vector<const RefCounted*> objects;
+    {
+        std::lock_guard<std::mutex> lock(record->lock);
+        record->isAlive = false;
+        record->hasQueued = NULL;
+        objects.swap(record->queue);
+    }
+    idSlot() = EXITED;
+    for (auto it = objects.begin(); it != objects.end(); ++it) {
+        if ((*it)->merge()) {
+            RefCounted::destroy(*it);
+        }
+    }
+
+    // The queue is empty, and stays so until the id is reused.
+    std::lock_guard<std::mutex> lock(s_threadsLock);
+    record->nextFree = s_freeId;
+    s_freeId = id;
+}
+
+bool Thread::queueOrMerge(uint32_t owner, const RefCounted* object)
+{
+    ThreadRecord* record = s_threads[owner].load(std::memory_order_acquire);
+    std::lock_guard<std::mutex> lock(record->lock);
+    if (!record->isAlive) {
+        // Merging under the lock means the id can't be given to a new
+        // thread meanwhile, which would count the object as its own.
+        return object->merge();
+    }
+    record->queue.push_back(object);
+    record->hasQueued->store(true, std::memory_order_relaxed);
+    return false;
+}
+
+void Thread::takeQueued(std::vector<const RefCounted*>& objects)
+{
+    ThreadRecord* record = s_threads[id()].load(std::memory_order_acquire);
+    std::lock_guard<std::mutex> lock(record->lock);
+    objects.swap(record->queue);
+    queuedFlag().store(false, std::memory_order_relaxed);
+}
+
+namespace {
+
+// Records are never freed, only reused by later threads, so protect() may
+// read any record at any time.
+struct HazardRecord {
+    std::atomic<const void*> object;
+    std::atomic<bool>        isFree;
+    HazardRecord*            next;
+};
+
+struct HazardThread {
+    HazardRecord*                  record;
+    std::vector<const RefCounted*> retired;
+
+    ~HazardThread();
+};
+
+}
+
+static std::atomic<HazardRecord*> s_hazards(NULL);
+
+static thread_local HazardThread t_hazardThread;
+
+static bool isProtected(const RefCounted* object)
+{
+    for (HazardRecord* record = s_hazards.load(std::memory_order_acquire);
+         record; record = record->next) {
+        if (record->object.load() == object) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Releases the retired references whose objects aren't protected, and
+// returns the number left.
+static size_t releaseRetired(std::vector<const RefCounted*>& retired)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < retired.size(); i++) {
+        const RefCounted* object = retired[i];
+        if (isProtected(object)) {
+            retired[kept++] = object;
+        }
+        else if (object->release()) {
+            RefCounted::destroy(object);
+        }
+    }
+    retired.resize(kept);
+    return kept;
+}
+
+HazardThread::~HazardThread()
+{
+    // Readers protect objects only briefly, so wait for them.
+    while (releaseRetired(retired) > 0) {
+        std::this_thread::yield();
+    }
+    if (record) {
+        record->isFree.store(true, std::memory_order_release);
+    }
+}
+
+std::atomic<const void*>* Hazard::newSlot()
+{
+    HazardThread& thread = t_hazardThread;
+    for (HazardRecord* record = s_hazards.load(std::memory_order_acquire);
+         record; record = record->next) {
+        bool isFree = true;
+        if (record->isFree.compare_exchange_strong(isFree, false)) {
+            thread.record = record;
+            return &record->object;
+        }
+    }
+    HazardRecord* record = new HazardRecord;
+    record->object.store(NULL, std::memory_order_relaxed);
+    record->isFree.store(false, std::memory_order_relaxed);
+    record->next = s_hazards.load(std::memory_order_relaxed);
+    while (!s_hazards.compare_exchange_weak(record->next, record,
+                                            std::memory_order_release,
+                                            std::memory_order_relaxed)) {
+    }
+    thread.record = record;
+    return &record->object;
+}
+
+void Hazard::retire(const RefCounted* object)
+{
+    HazardThread& thread = t_hazardThread;
+    thread.retired.push_back(object);
+    releaseRetired(thread.retired);
+}
+
+bool RefCounted::disown() const
+{
+    // Other threads hold references, so the object becomes theirs. Whoever
+    // takes the count to zero frees it, which may be this thread.
+    m_owner.store(0, std::memory_order_relaxed);
+    const int old = m_shared.fetch_or(MERGED, std::memory_order_acq_rel);
+    return (old >> SHIFT) == 0;
+}
+
+bool RefCounted::releaseShared() const
+{
+    // A negative count means that the owner's count includes a reference
+    // which this thread has dropped. The owner must then merge the counts
+    // before the object can be freed, so deciding to queue it has to be
+    // part of the same atomic step as the decrement: once the decrement is
+    // visible, another thread may queue the object, and its owner free it.
+    int old = m_shared.load(std::memory_order_relaxed);
+    int next;
+    bool isQueuing;
+    do {
+        next = old - ONE;
+        isQueuing = !(old & (MERGED | QUEUED)) && (next < 0);
+        if (isQueuing) {
+            next |= QUEUED;
+        }
+    } while (!m_shared.compare_exchange_weak(old, next,
+                                             std::memory_order_acq_rel,
+                                             std::memory_order_relaxed));
+    if (old & MERGED) {
+        return (next >> SHIFT) == 0;
+    }
+    if (isQueuing) {
+        return Thread::queueOrMerge(m_owner.load(std::memory_order_relaxed),
+                                    this);
+    }
+    return false;
+}
+
+bool RefCounted::merge() const
+{
+    const int biased = m_biased;
+    m_biased = 0;
+    m_owner.store(0, std::memory_order_relaxed);
+    int old = m_shared.load(std::memory_order_relaxed);
+    int next;
+    do {
+        next = ((old & ~QUEUED) + biased * ONE) | MERGED;
+    } while (!m_shared.compare_exchange_weak(old, next,
+                                             std::memory_order_acq_rel,
+                                             std::memory_order_relaxed));
+    return (next >> SHIFT) == 0;
+}
+
+bool RefCounted::mergeQueuedSlow()
+{
+    std::vector<const RefCounted*> objects;
+    Thread::takeQueued(objects);
+    for (auto it = objects.begin(); it != objects.end(); ++it) {
+        if ((*it)->merge()) {
+            destroy(*it);
+        }
+    }
+    return !objects.empty();
+}
+
+#endif // MAL_THREADS
@@ -0,0 +1,276 @@
+#ifndef INCLUDE_THREADS_H
+#define INCLUDE_THREADS_H
+
+// Building with MAL_THREADS defined (make THREADS=1) makes the interpreter
+// safe to use from several threads at once: reference counts are atomic,
+// and values with caches or other mutable state lock around them. Without
+// it, everything here compiles down to the plain single threaded code.
+//
+// Each thread evaluates on a frame stack of its own, and the profiler only
+// records the thread which started it.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef MAL_THREADS
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define MAL_THREAD_LOCAL thread_local
+
+template <class T> using Atomic = std::atomic<T>;
+
+// For values whose state is only ever locked for a few instructions.
+class SpinLock {
+public:
+    constexpr SpinLock() : m_isLocked(false) { }
+
+    void lock() {
+        while (m_isLocked.exchange(true, std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+    }
+    void unlock() { m_isLocked.store(false, std::memory_order_release); }
+
+private:
+    std::atomic<bool> m_isLocked;
+};
+
+// For values which are locked while they run Mal code. Recursive, so that a
+// lazy sequence which needs itself to be realised still fails as it would
+// without threads, by running out of stack.
+typedef std::recursive_mutex Mutex;
+
+// Any number of readers, or one writer. Readers take no turns, so this suits
+// things which are read much more often than written, like environments.
+class SharedLock {
+public:
+    SharedLock() : m_state(0) { }
+
+    void lockShared() {
+        for (;;) {
+            int state = m_state.fetch_add(READER, std::memory_order_acquire);
+            if (!(state & WRITER)) {
+                return;
+            }
+            m_state.fetch_sub(READER, std::memory_order_relaxed);
+            while (m_state.load(std::memory_order_relaxed) & WRITER) {
+                std::this_thread::yield();
+            }
+        }
+    }
+    void unlockShared() {
+        m_state.fetch_sub(READER, std::memory_order_release);
+    }
+
+    void lock() {
+        int expected = 0;
+        while (!m_state.compare_exchange_weak(expected, WRITER,
+                                              std::memory_order_acquire,
+                                              std::memory_order_relaxed)) {
+            expected = 0;
+            std::this_thread::yield();
+        }
+    }
+    void unlock() { m_state.fetch_sub(WRITER, std::memory_order_release); }
+
+private:
+    static const int WRITER = 1;
+    static const int READER = 2;
+
+    std::atomic<int> m_state;
+};
+
+// One of a fixed set of spin locks, chosen by address, for values which are
+// too numerous to each carry a lock of their own.
+SpinLock& lockFor(const void* object);
+
+class RefCounted;
+
+// Numbers the threads which use the interpreter, from 1, as they first
+// touch a reference count, and keeps the queues of objects waiting for
+// their owning threads to merge their reference counts. The numbers of
+// threads which have exited are given to new ones.
+class Thread {
+public:
+    // The id of a thread once it has started to exit.
+    static const uint32_t EXITED = 0xffffffff;
+
+    // Throws if too many threads are using the interpreter at once.
+    static uint32_t id() {
+        const uint32_t id = idSlot();
+        return id ? id : attach();
+    }
+
+    static bool hasQueued() {
+        return queuedFlag().load(std::memory_order_relaxed);
+    }
+
+    // Queues an object for its owner to merge, and returns false. If the
+    // owner has exited, merges the counts instead, and returns true if
+    // that released the last reference.
+    static bool queueOrMerge(uint32_t owner, const RefCounted* object);
+
+    // Takes the objects queued for this thread.
+    static void takeQueued(std::vector<const RefCounted*>& objects);
+
+private:
+    static uint32_t& idSlot() {
+        static thread_local uint32_t t_id = 0;
+        return t_id;
+    }
+    static std::atomic<bool>& queuedFlag() {
+        static thread_local std::atomic<bool> t_hasQueued(false);
+        return t_hasQueued;
+    }
+
+    static uint32_t attach();
+    static void detach();
+
+    friend struct ThreadExit;
+};
+
+// Hazard pointers, for taking a reference to an object held by an atomic
+// pointer which other threads may replace meanwhile. A reader protects the
+// object while it takes its reference, and a writer retires the reference
+// held by the pointer it replaced instead of releasing it, so it's only
+// released once no thread protects the object.
+class Hazard {
+public:
+    // Protects the object which pointer holds, and returns it.
+    template <class T>
+    static T* protect(const std::atomic<T*>& pointer) {
+        std::atomic<const void*>& hazard = slot();
+        T* object = pointer.load(std::memory_order_relaxed);
+        for (;;) {
+            hazard.store(object);
+            T* current = pointer.load();
+            if (current == object) {
+                return object;
+            }
+            object = current;
+        }
+    }
+
+    // Ends the protection of the object last protected.
+    static void clear() { slot().store(NULL, std::memory_order_release); }
+
+    // Releases a reference once no thread protects the object.
+    static void retire(const RefCounted* object);
+
+private:
+    static std::atomic<const void*>& slot() {
+        static thread_local std::atomic<const void*>* t_slot = NULL;
+        if (!t_slot) {
+            t_slot = newSlot();
+        }
+        return *t_slot;
+    }
+    static std::atomic<const void*>* newSlot();
+};
+
+#else // MAL_THREADS
+
+#define MAL_THREAD_LOCAL
+
+template <class T> using Atomic = T;
+
+class SpinLock {
+public:
+    void lock() { }
+    void unlock() { }
+};
+
+typedef SpinLock Mutex;
+
+class SharedLock {
+public:
+    void lockShared() { }
+    void unlockShared() { }
+    void lock() { }
+    void unlock() { }
+};
+
+inline SpinLock& lockFor(const void* object)
+{
+    static SpinLock lock;
+    return lock;
+}
+
+#endif // MAL_THREADS
+
+template <class Lock>
+class LockGuard {
+public:
+    LockGuard(Lock& lock) : m_lock(lock) { m_lock.lock(); }
+    ~LockGuard() { m_lock.unlock(); }
+
+private:
+    LockGuard(const LockGuard&);
+    LockGuard& operator = (const LockGuard&);
+
+    Lock& m_lock;
+};
+
+class SharedLockGuard {
+public:
+    SharedLockGuard(SharedLock& lock) : m_lock(lock) { m_lock.lockShared(); }
+    ~SharedLockGuard() { m_lock.unlockShared(); }
+
+private:
+    SharedLockGuard(const SharedLockGuard&);
+    SharedLockGuard& operator = (const SharedLockGuard&);
+
+    SharedLock& m_lock;
+};
+
+// A counter for the runtime statistics. With threads, each thread adds to a
+// count of its own, so that counting doesn't make them contend for a cache
+// line, and reading the counter totals them up.
+class StatCounter {
+public:
+#ifdef MAL_THREADS
+    constexpr StatCounter() : m_index(-1) { }
+
+    void add(int64_t delta) {
+        std::atomic<int64_t>& count = threadCounts()[index()];
+        count.store(count.load(std::memory_order_relaxed) + delta,
+                    std::memory_order_relaxed);
+    }
+
+    int64_t value() const;
+
+    static const int CAPACITY = 128;
+
+private:
+    int index() {
+        int index = m_index.load(std::memory_order_relaxed);
+        return (index >= 0) ? index : assignIndex();
+    }
+    int assignIndex();
+
+    static std::atomic<int64_t>* threadCounts() {
+        static thread_local std::atomic<int64_t>* t_counts = NULL;
+        if (!t_counts) {
+            t_counts = newThreadCounts();
+        }
+        return t_counts;
+    }
+    static std::atomic<int64_t>* newThreadCounts();
+
+    std::atomic<int> m_index;
+#else
+    constexpr StatCounter() : m_value(0) { }
+
+    void add(int64_t delta) { m_value += delta; }
+    int64_t value() const { return m_value; }
+
+private:
+    int64_t m_value;
+#endif
+};
+
+#endif // INCLUDE_THREADS_H
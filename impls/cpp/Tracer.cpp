@@ -0,0 +1,144 @@
+#include "Tracer.h"
+
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+Atomic<bool>    Tracer::s_isEnabled(false);
+Atomic<int64_t> Tracer::s_lambdaThresholdNs(0);
+
+namespace {
+
+struct Event {
+    const char* category;
+    String      name;
+    String      detail;
+    int64_t     startNs;
+    int64_t     durationNs;
+};
+
+// The spans recorded by one thread. Buffers are only written by their own
+// thread, and start() bumps the generation rather than touching them, so
+// that each buffer discards its old spans the next time it's written.
+//
+// A thread sets isRecording before it checks that tracing is enabled, and
+// clears it once it has written its span, so write(), which runs once
+// tracing is stopped, only has to wait for those spans already underway.
+struct Buffer {
+    static const size_t CAPACITY = 1 << 15;
+
+    Buffer(int tid) : events(CAPACITY), next(0), count(0), tid(tid),
+                      generation(0), isRecording(false) { }
+
+    std::vector<Event> events;
+    size_t             next;
+    size_t             count;
+    int                tid;
+    int                generation;
+    Atomic<bool>       isRecording;
+};
+
+}
+
+static std::mutex           s_buffersLock;
+static std::vector<Buffer*> s_buffers;      // never freed, threads may exit
+static Atomic<int>          s_generation(0);
+static Atomic<int64_t>      s_startNs(0);
+
+static thread_local Buffer* t_buffer = NULL;
+
+int64_t Tracer::nowNs()
+{
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(
+        steady_clock::now().time_since_epoch()).count();
+}
+
+void Tracer::start(int64_t lambdaThresholdNs)
+{
+    std::lock_guard<std::mutex> lock(s_buffersLock);
+    s_generation++;
+    s_startNs = nowNs();
+    s_lambdaThresholdNs = lambdaThresholdNs;
+    s_isEnabled = true;
+}
+
+void Tracer::stop()
+{
+    s_isEnabled = false;
+}
+
+void Tracer::record(const char* category, const String& name,
+                    const String& detail, int64_t startNs, int64_t durationNs)
+{
+    Buffer* buffer = t_buffer;
+    if (!buffer) {
+        std::lock_guard<std::mutex> lock(s_buffersLock);
+        buffer = t_buffer = new Buffer(s_buffers.size() + 1);
+        s_buffers.push_back(buffer);
+    }
+    // Spans which end after tracing stops are dropped.
+    buffer->isRecording = true;
+    if (!s_isEnabled) {
+        buffer->isRecording = false;
+        return;
+    }
+    if (buffer->generation != s_generation) {
+        buffer->generation = s_generation;
+        buffer->next = buffer->count = 0;
+    }
+
+    Event& event = buffer->events[buffer->next];
+    event.category = category;
+    event.name = name;
+    event.detail = detail;
+    event.startNs = startNs;
+    event.durationNs = durationNs;
+    buffer->next = (buffer->next + 1) % Buffer::CAPACITY;
+    if (buffer->count < Buffer::CAPACITY) {
+        buffer->count++;
+    }
+    buffer->isRecording = false;
+}
+
+static String eventJson(const Event& event, int tid)
+{
+    String json = STRF("{\"name\": %s, \"cat\": \"%s\", \"ph\": \"X\", "
+                       "\"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %d",
+                       escape(event.name).c_str(), event.category,
+                       (event.startNs - s_startNs) / 1e3,
+                       event.durationNs / 1e3, tid);
+    if (!event.detail.empty()) {
+        json += ", \"args\": {\"detail\": " + escape(event.detail) + "}";
+    }
+    return json + "}";
+}
+
+void Tracer::write(const String& filename)
+{
+    std::ofstream file(filename.c_str());
+    MAL_CHECK(!file.fail(), "Cannot open %s", filename.c_str());
+
+    std::lock_guard<std::mutex> lock(s_buffersLock);
+    file << "{\"traceEvents\": [";
+    const char* separator = "\n";
+    for (auto it = s_buffers.begin(); it != s_buffers.end(); ++it) {
+        const Buffer* buffer = *it;
+        while (buffer->isRecording) {
+            std::this_thread::yield();
+        }
+        if (buffer->generation != s_generation) {
+            continue;
+        }
+        size_t index = (buffer->next + Buffer::CAPACITY - buffer->count)
+                     % Buffer::CAPACITY;
+        for (size_t i = 0; i < buffer->count; i++) {
+            file << separator << eventJson(buffer->events[index], buffer->tid);
+            separator = ",\n";
+            index = (index + 1) % Buffer::CAPACITY;
+        }
+    }
+    file << "\n], \"displayTimeUnit\": \"ms\"}\n";
+}
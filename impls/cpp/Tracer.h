@@ -0,0 +1,74 @@
+#ifndef INCLUDE_TRACER_H
+#define INCLUDE_TRACER_H
+
+#include "MAL.h"
+#include "Threads.h"
+
+#include <stdint.h>
+
+// Records timed spans of work, such as top level evaluations, reading files
+// and expanding macros, and writes them out in the Chrome Trace Event
+// format, which trace viewers such as Perfetto and chrome://tracing open.
+//
+// Each thread records into a ring buffer of its own, so recording takes no
+// locks. Once a buffer is full, new spans overwrite the oldest ones.
+//
+// Lambda calls are timed by the Profiler's shadow call stack, and recorded
+// here if they took at least the threshold given to start().
+class Tracer {
+public:
+    static const int64_t DEFAULT_LAMBDA_THRESHOLD_NS = 100000;
+
+    static bool isEnabled() { return s_isEnabled; }
+
+    // Starting discards any spans recorded before.
+    static void start(int64_t lambdaThresholdNs);
+    static void stop();
+
+    static int64_t lambdaThresholdNs() { return s_lambdaThresholdNs; }
+
+    // Records the time from its construction to its destruction.
+    class Span {
+    public:
+        Span(const char* category, const String& name,
+             const String& detail = String())
+        : m_isActive(s_isEnabled), m_startNs(0) {
+            if (m_isActive) {
+                m_category = category;
+                m_name = name;
+                m_detail = detail;
+                m_startNs = nowNs();
+            }
+        }
+
+        ~Span() {
+            if (m_isActive) {
+                record(m_category, m_name, m_detail,
+                       m_startNs, nowNs() - m_startNs);
+            }
+        }
+
+    private:
+        bool        m_isActive;
+        const char* m_category;
+        String      m_name;
+        String      m_detail;
+        int64_t     m_startNs;
+    };
+
+    static void record(const char* category, const String& name,
+                       const String& detail, int64_t startNs,
+                       int64_t durationNs);
+
+    // Writes the spans recorded by all threads as Chrome Trace Event JSON.
+    // Tracing must have been stopped first.
+    static void write(const String& filename);
+
+    static int64_t nowNs();
+
+private:
+    static Atomic<bool>    s_isEnabled;
+    static Atomic<int64_t> s_lambdaThresholdNs;
+};
+
+#endif // INCLUDE_TRACER_H
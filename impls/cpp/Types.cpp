@@ -1,10 +1,49 @@
 #include "Debug.h"
 #include "Environment.h"
+#include "Profiler.h"
+#include "ThreadPool.h"
+#include "Tracer.h"
 #include "Types.h"
 
 #include <algorithm>
+#include <functional>
+#include <list>
 #include <memory>
+#include <stdexcept>
 #include <typeinfo>
+#include <unordered_map>
+
+#ifdef MAL_THREADS
+#include <condition_variable>
+#endif
+
+StatCounter RefCounted::s_allocations;
+StatCounter RefCounted::s_acquires;
+
+void RefCounted::destroy(const RefCounted* object)
+{
+    // Deep enough to spare the queue for everything but long chains, and
+    // shallow enough for any thread's stack.
+    const int maxDepth = 1000;
+    static MAL_THREAD_LOCAL int t_depth = 0;
+    static MAL_THREAD_LOCAL std::vector<const RefCounted*>* t_queue = NULL;
+
+    if (t_depth == maxDepth) {
+        if (!t_queue) {
+            t_queue = new std::vector<const RefCounted*>;
+        }
+        t_queue->push_back(object);
+        return;
+    }
+    t_depth++;
+    delete object;
+    while ((t_depth == 1) && t_queue && !t_queue->empty()) {
+        const RefCounted* queued = t_queue->back();
+        t_queue->pop_back();
+        delete queued;
+    }
+    t_depth--;
+}
 
 namespace mal {
     malValuePtr atom(malValuePtr value) {
@@ -19,11 +58,24 @@ namespace mal {
         return malValuePtr(new malBuiltIn(name, handler));
     };
 
+    malValuePtr builtin(const String& name,
+                        const malBuiltIn::Function& function) {
+        return malValuePtr(new malBuiltIn(name, function));
+    };
+
+    malValuePtr composition(malValueIter begin, malValueIter end) {
+        return malValuePtr(new malComposition(begin, end));
+    }
+
     malValuePtr falseValue() {
         static malValuePtr c(new malConstant("false"));
         return malValuePtr(c);
     };
 
+    malValuePtr future(malValuePtr thunk) {
+        return malValuePtr(new malFuture(thunk));
+    }
+
 
     malValuePtr hash(const malHash::Map& map) {
         return malValuePtr(new malHash(map));
@@ -39,9 +91,18 @@ namespace mal {
     };
 
     malValuePtr integer(const String& token) {
-        return integer(std::stoi(token));
+        try {
+            return integer(std::stoll(token));
+        }
+        catch (std::out_of_range&) {
+            MAL_FAIL("Integer %s is out of range", token.c_str());
+        }
     };
 
+    malValuePtr intArray(malIntArray::Vec* items) {
+        return malValuePtr(new malIntArray(items));
+    }
+
     malValuePtr keyword(const String& token) {
         return malValuePtr(new malKeyword(token));
     };
@@ -51,6 +112,14 @@ namespace mal {
         return malValuePtr(new malLambda(bindings, body, env));
     }
 
+    malValuePtr lazySeq(malLazySeq::Generator* generator) {
+        return malValuePtr(new malLazySeq(generator));
+    }
+
+    malValuePtr lazySeq(malValuePtr first, malValuePtr rest) {
+        return malValuePtr(new malLazySeq(first, rest));
+    }
+
     malValuePtr list(malValueVec* items) {
         return malValuePtr(new malList(items));
     };
@@ -84,11 +153,23 @@ namespace mal {
         return malValuePtr(new malLambda(lambda, true));
     };
 
+    malValuePtr memoized(malValuePtr op, size_t capacity) {
+        return malValuePtr(new malMemoized(op, capacity));
+    }
+
     malValuePtr nilValue() {
         static malValuePtr c(new malConstant("nil"));
         return malValuePtr(c);
     };
 
+    malValuePtr promise() {
+        return malValuePtr(new malFuture(NULL));
+    }
+
+    malValuePtr quasiquote(malValuePtr form) {
+        return malValuePtr(new malQuasiquote(form));
+    }
+
     malValuePtr string(const String& token) {
         return malValuePtr(new malString(token));
     }
@@ -97,6 +178,10 @@ namespace mal {
         return malValuePtr(new malSymbol(token));
     };
 
+    malValuePtr transducer(const malTransducer::StepVec& steps) {
+        return malValuePtr(new malTransducer(steps));
+    }
+
     malValuePtr trueValue() {
         static malValuePtr c(new malConstant("true"));
         return malValuePtr(c);
@@ -109,12 +194,21 @@ namespace mal {
     malValuePtr vector(malValueIter begin, malValueIter end) {
         return malValuePtr(new malVector(begin, end));
     };
+
+    bool isSequential(const malValue* value) {
+        return dynamic_cast<const malSequence*>(value)
+            || dynamic_cast<const malLazySeq*>(value);
+    }
 };
 
 malValuePtr malBuiltIn::apply(malValueIter argsBegin,
                               malValueIter argsEnd) const
 {
-    return m_handler(m_name, argsBegin, argsEnd);
+    Profiler::Scope scope(const_cast<malBuiltIn*>(this));
+    if (m_handler) {
+        return m_handler(m_name, argsBegin, argsEnd);
+    }
+    return m_function(m_name, argsBegin, argsEnd);
 }
 
 static String makeHashKey(malValuePtr key)
@@ -140,6 +234,26 @@ static malHash::Map addToMap(malHash::Map& map,
     return map;
 }
 
+static bool allLiteral(malValueIter begin, malValueIter end)
+{
+    for (auto it = begin; it != end; ++it) {
+        if (!(*it)->isLiteral()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool allLiteral(const malHash::Map& map)
+{
+    for (auto it = map.begin(), end = map.end(); it != end; ++it) {
+        if (!it->second->isLiteral()) {
+            return false;
+        }
+    }
+    return true;
+}
+
 static malHash::Map createMap(malValueIter argsBegin, malValueIter argsEnd)
 {
     MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
@@ -152,13 +266,15 @@ static malHash::Map createMap(malValueIter argsBegin, malValueIter argsEnd)
 malHash::malHash(malValueIter argsBegin, malValueIter argsEnd, bool isEvaluated)
 : m_map(createMap(argsBegin, argsEnd))
 , m_isEvaluated(isEvaluated)
+, m_isLiteral(allLiteral(m_map))
 {
 
 }
 
-malHash::malHash(const malHash::Map& map)
+malHash::malHash(const malHash::Map& map, bool isEvaluated)
 : m_map(map)
-, m_isEvaluated(true)
+, m_isEvaluated(isEvaluated)
+, m_isLiteral(allLiteral(m_map))
 {
 
 }
@@ -192,7 +308,7 @@ malHash::dissoc(malValueIter argsBegin, malValueIter argsEnd) const
 
 malValuePtr malHash::eval(malEnvPtr env)
 {
-    if (m_isEvaluated) {
+    if (m_isEvaluated || m_isLiteral) {
         return malValuePtr(this);
     }
 
@@ -270,12 +386,19 @@ bool malHash::doIsEqualTo(const malValue* rhs) const
     return true;
 }
 
+static bool hasImpureMeta(malValuePtr meta)
+{
+    const malHash* hash = DYNAMIC_CAST(malHash, meta);
+    return hash && hash->get(mal::keyword(":impure"))->isTrue();
+}
+
 malLambda::malLambda(const StringVec& bindings,
                      malValuePtr body, malEnvPtr env)
 : m_bindings(bindings)
 , m_body(body)
 , m_env(env)
 , m_isMacro(false)
+, m_isImpure(false)
 {
 
 }
@@ -286,6 +409,8 @@ malLambda::malLambda(const malLambda& that, malValuePtr meta)
 , m_body(that.m_body)
 , m_env(that.m_env)
 , m_isMacro(that.m_isMacro)
+, m_isImpure(hasImpureMeta(meta))
+, m_name(that.m_name)
 {
 
 }
@@ -296,6 +421,8 @@ malLambda::malLambda(const malLambda& that, bool isMacro)
 , m_body(that.m_body)
 , m_env(that.m_env)
 , m_isMacro(isMacro)
+, m_isImpure(that.m_isImpure)
+, m_name(that.m_name)
 {
 
 }
@@ -303,19 +430,690 @@ malLambda::malLambda(const malLambda& that, bool isMacro)
 malValuePtr malLambda::apply(malValueIter argsBegin,
                              malValueIter argsEnd) const
 {
+    Profiler::Scope scope(const_cast<malLambda*>(this));
     return EVAL(m_body, makeEnv(argsBegin, argsEnd));
 }
 
+String malIntArray::print(bool readably) const
+{
+    String str;
+    for (auto it = m_items->begin(), end = m_items->end(); it != end; ++it) {
+        if (!str.empty()) {
+            str += " ";
+        }
+        str += std::to_string(*it);
+    }
+    return "#int-array[" + str + "]";
+}
+
+static size_t hashCombine(size_t seed, size_t hash)
+{
+    return seed ^ (hash + 0x9e3779b9 + (seed << 6) + (seed >> 2));
+}
+
+// Lists, vectors and lazy sequences with equal items are equal, so they
+// all hash the same way.
+static size_t hashItems(malValuePtr seq)
+{
+    size_t hash = 0;
+    for (malIterator it(seq); !it.atEnd(); it.next()) {
+        hash = hashCombine(hash, it.value()->hashCode());
+    }
+    return hash;
+}
+
+size_t malValue::hashCode() const
+{
+    return std::hash<const void*>()(this);
+}
+
+size_t malInteger::hashCode() const
+{
+    return std::hash<int64_t>()(m_value);
+}
+
+size_t malStringBase::hashCode() const
+{
+    return std::hash<String>()(m_value);
+}
+
+size_t malSequence::hashCode() const
+{
+    return hashItems(const_cast<malSequence*>(this));
+}
+
+size_t malLazySeq::hashCode() const
+{
+    return hashItems(const_cast<malLazySeq*>(this));
+}
+
+size_t malHash::hashCode() const
+{
+    size_t hash = 0;
+    for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
+        hash = hashCombine(hash, std::hash<String>()(it->first));
+        hash = hashCombine(hash, it->second->hashCode());
+    }
+    return hash;
+}
+
+size_t malIntArray::hashCode() const
+{
+    size_t hash = 0;
+    for (auto it = m_items->begin(), end = m_items->end(); it != end; ++it) {
+        hash = hashCombine(hash, std::hash<int64_t>()(*it));
+    }
+    return hash;
+}
+
+class malMemoized::Cache : public RefCounted {
+public:
+    Cache(size_t capacity)
+    : m_capacity(capacity), m_hits(0), m_misses(0) { }
+
+    // Returns NULL if there's no result for these arguments.
+    malValuePtr find(const malValueVec& args) {
+        LockGuard<Mutex> lock(m_lock);
+        auto it = m_index.find(&args);
+        if (it == m_index.end()) {
+            m_misses++;
+            return NULL;
+        }
+        m_hits++;
+        m_entries.splice(m_entries.begin(), m_entries, it->second);
+        return it->second->result;
+    }
+
+    void insert(const malValueVec& args, malValuePtr result) {
+        LockGuard<Mutex> lock(m_lock);
+        // A recursive call may have stored a result for these already.
+        if (m_index.find(&args) != m_index.end()) {
+            return;
+        }
+        if ((m_capacity > 0) && (m_entries.size() == m_capacity)) {
+            m_index.erase(&m_entries.back().args);
+            m_entries.pop_back();
+        }
+        m_entries.push_front(Entry { args, result });
+        m_index[&m_entries.front().args] = m_entries.begin();
+    }
+
+    const size_t    m_capacity;
+    Atomic<int64_t> m_hits;
+    Atomic<int64_t> m_misses;
+
+    size_t size() const {
+        LockGuard<Mutex> lock(m_lock);
+        return m_entries.size();
+    }
+
+private:
+    struct Entry {
+        malValueVec args;
+        malValuePtr result;
+    };
+    typedef std::list<Entry> EntryList; // most recently used first
+
+    struct ArgsHash {
+        size_t operator () (const malValueVec* args) const {
+            size_t hash = args->size();
+            for (auto it = args->begin(), end = args->end(); it != end; ++it) {
+                hash = hashCombine(hash, (*it)->hashCode());
+            }
+            return hash;
+        }
+    };
+
+    struct ArgsEqual {
+        bool operator () (const malValueVec* lhs, const malValueVec* rhs) const {
+            if (lhs->size() != rhs->size()) {
+                return false;
+            }
+            for (size_t i = 0; i < lhs->size(); i++) {
+                if (!(*lhs)[i]->isEqualTo((*rhs)[i].ptr())) {
+                    return false;
+                }
+            }
+            return true;
+        }
+    };
+
+    // Arguments may be lazy sequences, so hashing and comparing them can
+    // run Mal code, which may call back into the cache.
+    mutable Mutex m_lock;
+    EntryList     m_entries;
+    std::unordered_map<const malValueVec*, EntryList::iterator,
+                       ArgsHash, ArgsEqual> m_index;
+};
+
+malMemoized::malMemoized(malValuePtr op, size_t capacity)
+: m_op(op)
+, m_cache(new Cache(capacity))
+{
+
+}
+
+malMemoized::malMemoized(const malMemoized& that, malValuePtr meta)
+: malApplicable(meta)
+, m_op(that.m_op)
+, m_cache(that.m_cache)
+{
+
+}
+
+malMemoized::~malMemoized()
+{
+
+}
+
+malValuePtr malMemoized::apply(malValueIter argsBegin,
+                               malValueIter argsEnd) const
+{
+    malValueVec args(argsBegin, argsEnd);
+    malValuePtr result = m_cache->find(args);
+    if (!result) {
+        result = APPLY(m_op, args.begin(), args.end());
+        m_cache->insert(args, result);
+    }
+    return result;
+}
+
+int64_t malMemoized::hits() const
+{
+    return m_cache->m_hits;
+}
+
+int64_t malMemoized::misses() const
+{
+    return m_cache->m_misses;
+}
+
+size_t malMemoized::size() const
+{
+    return m_cache->size();
+}
+
+size_t malMemoized::capacity() const
+{
+    return m_cache->m_capacity;
+}
+
+// What a future or promise delivers, which is shared with the task which
+// delivers it, and with any copies with other metadata.
+class malFuture::State : public RefCounted {
+public:
+    State() : m_isDone(false), m_isError(false) { }
+
+    bool isDone() const { return m_isDone; }
+
+    // Either the value, or the exception thrown instead. Returns false if
+    // something has been delivered already.
+    bool deliver(malValuePtr value, const malValuePtr& exception,
+                 const String& error) {
+        {
+            LockGuard<Lock> lock(m_lock);
+            if (m_isDone) {
+                return false;
+            }
+            m_value = value;
+            m_exception = exception;
+            m_error = error;
+            m_isError = !value;
+            m_isDone = true;
+        }
+#ifdef MAL_THREADS
+        m_wake.notify_all();
+#endif
+        return true;
+    }
+
+    // Waits for at most timeoutNs.
+    void wait(int64_t timeoutNs) {
+#ifdef MAL_THREADS
+        std::unique_lock<std::mutex> lock(m_lock);
+        m_wake.wait_for(lock, std::chrono::nanoseconds(timeoutNs),
+                        [this]() { return (bool)m_isDone; });
+#endif
+    }
+
+    malValuePtr result() const {
+        if (m_isError) {
+            if (m_exception) {
+                throw m_exception;
+            }
+            throw m_error;
+        }
+        return m_value;
+    }
+
+private:
+#ifdef MAL_THREADS
+    typedef std::mutex Lock;
+    std::condition_variable m_wake;
+#else
+    typedef SpinLock Lock;
+#endif
+    Lock         m_lock;
+    Atomic<bool> m_isDone;
+    bool         m_isError;
+    malValuePtr  m_value;
+    malValuePtr  m_exception; // what throw threw, or NULL for an error
+    String       m_error;
+};
+
+malFuture::malFuture(malValuePtr thunk)
+: m_isPromise(!thunk)
+, m_state(new State)
+{
+    if (thunk) {
+        RefCountedPtr<State> state = m_state;
+        ThreadPool::submit([state, thunk]() {
+            Tracer::Span span("future", "future");
+            try {
+                malValueVec args;
+                state->deliver(APPLY(thunk, args.begin(), args.end()),
+                               NULL, String());
+            }
+            catch (malValuePtr& exception) {
+                state->deliver(NULL, exception, String());
+            }
+            catch (String& error) {
+                state->deliver(NULL, NULL, error);
+            }
+            catch (...) {
+                state->deliver(NULL, NULL, "Unknown exception in future");
+            }
+        });
+    }
+}
+
+malFuture::malFuture(const malFuture& that, malValuePtr meta)
+: malValue(meta)
+, m_isPromise(that.m_isPromise)
+, m_state(that.m_state)
+{
+
+}
+
+malFuture::~malFuture()
+{
+
+}
+
+bool malFuture::isRealised() const
+{
+    return m_state->isDone();
+}
+
+bool malFuture::deliver(malValuePtr value) const
+{
+    return m_state->deliver(value, NULL, String());
+}
+
+malValuePtr malFuture::deref(int64_t timeoutNs) const
+{
+    // Waiting is in slices, so that tasks queued meanwhile get help too.
+    const int64_t sliceNs = 1000000;
+    const int64_t deadlineNs = Tracer::nowNs() + timeoutNs;
+    while (!m_state->isDone()) {
+        if (ThreadPool::runOne()) {
+            continue;
+        }
+        int64_t waitNs = sliceNs;
+        if (timeoutNs >= 0) {
+            waitNs = std::min(waitNs, deadlineNs - Tracer::nowNs());
+            if (waitNs <= 0) {
+                return NULL;
+            }
+        }
+#ifdef MAL_THREADS
+        m_state->wait(waitNs);
+#else
+        // Nothing else can deliver it.
+        MAL_CHECK(timeoutNs >= 0, "Deref of an undelivered %s would never "
+                  "return", m_isPromise ? "promise" : "future");
+        return NULL;
+#endif
+    }
+    return m_state->result();
+}
+
+malValuePtr malComposition::apply(malValueIter argsBegin,
+                                  malValueIter argsEnd) const
+{
+    auto it = m_functions.rbegin();
+    malValueVec value(1, APPLY(*it, argsBegin, argsEnd));
+    for (++it; it != m_functions.rend(); ++it) {
+        value[0] = APPLY(*it, value.begin(), value.end());
+    }
+    return value[0];
+}
+
 malValuePtr malLambda::doWithMeta(malValuePtr meta) const
 {
     return new malLambda(*this, meta);
 }
 
+malEnvPtr malLambda::getEnv() const
+{
+    return m_env;
+}
+
 malEnvPtr malLambda::makeEnv(malValueIter argsBegin, malValueIter argsEnd) const
 {
     return malEnvPtr(new malEnv(m_env, m_bindings, argsBegin, argsEnd));
 }
 
+// Generates the items of a sequence, or nil, from index onwards.
+class SequenceGenerator : public malLazySeq::Generator {
+public:
+    SequenceGenerator(malValuePtr seq, int index)
+    : m_seq(seq), m_index(index) { }
+
+    virtual malValuePtr generate() {
+        const malSequence* seq = DYNAMIC_CAST(malSequence, m_seq);
+        if (!seq || (m_index >= seq->count())) {
+            return mal::nilValue();
+        }
+        return mal::lazySeq(seq->item(m_index),
+            mal::lazySeq(new SequenceGenerator(m_seq, m_index + 1)));
+    }
+
+private:
+    const malValuePtr m_seq;
+    const int         m_index;
+};
+
+malLazySeq::malLazySeq(Generator* generator)
+: m_isRealised(false)
+, m_generator(generator)
+{
+
+}
+
+malLazySeq::malLazySeq(malValuePtr first, malValuePtr rest)
+: m_isRealised(true)
+, m_first(first)
+, m_rest(DYNAMIC_CAST(malLazySeq, rest) ? rest
+         : mal::lazySeq(new SequenceGenerator(rest, 0)))
+{
+    if (!DYNAMIC_CAST(malLazySeq, rest) && (rest != mal::nilValue())) {
+        VALUE_CAST(malSequence, rest);
+    }
+}
+
+malLazySeq::malLazySeq(const malLazySeq& that, malValuePtr meta)
+: malValue(meta)
+, m_isRealised(true)
+{
+    that.realise();
+    m_first = that.m_first;
+    m_rest  = that.m_rest;
+}
+
+malLazySeq::~malLazySeq()
+{
+    // Unlink the realised tail one cell at a time, so that freeing a long
+    // chain doesn't recurse once per item.
+    malValuePtr rest = m_rest;
+    m_rest = NULL;
+    while (rest && rest->isUnique()) {
+        malLazySeq* cell = STATIC_CAST(malLazySeq, rest);
+        malValuePtr next = cell->m_rest;
+        cell->m_rest = NULL;
+        rest = next;
+    }
+}
+
+void malLazySeq::realise() const
+{
+    if (m_isRealised) {
+        return;
+    }
+    // Once realised, a lazy sequence never changes again, so only threads
+    // which find it unrealised need to lock.
+    LockGuard<Mutex> lock(m_lock);
+    if (m_isRealised) {
+        return;
+    }
+
+    malValuePtr value = m_generator->generate();
+    if (const malLazySeq* lazy = DYNAMIC_CAST(malLazySeq, value)) {
+        lazy->realise();
+        m_first = lazy->m_first;
+        m_rest  = lazy->m_rest;
+    }
+    else if (value != mal::nilValue()) {
+        const malSequence* seq = VALUE_CAST(malSequence, value);
+        if (!seq->isEmpty()) {
+            m_first = seq->first();
+            m_rest  = mal::lazySeq(new SequenceGenerator(value, 1));
+        }
+    }
+    m_generator = NULL;
+    m_isRealised = true;
+}
+
+malValuePtr malLazySeq::first() const
+{
+    return isEmpty() ? mal::nilValue() : m_first;
+}
+
+malValuePtr malLazySeq::rest() const
+{
+    return isEmpty() ? malValuePtr(const_cast<malLazySeq*>(this)) : m_rest;
+}
+
+String malLazySeq::print(bool readably) const
+{
+    String str;
+    for (malIterator it(const_cast<malLazySeq*>(this)); !it.atEnd(); it.next()) {
+        if (!str.empty()) {
+            str += " ";
+        }
+        str += it.value()->print(readably);
+    }
+    return '(' + str + ')';
+}
+
+bool malLazySeq::doIsEqualTo(const malValue* rhs) const
+{
+    malIterator it0(const_cast<malLazySeq*>(this));
+    malIterator it1(const_cast<malValue*>(rhs));
+    for ( ; !it0.atEnd() && !it1.atEnd(); it0.next(), it1.next()) {
+        if (!it0.value()->isEqualTo(it1.value().ptr())) {
+            return false;
+        }
+    }
+    return it0.atEnd() && it1.atEnd();
+}
+
+malIterator::malIterator(malValuePtr seq)
+: m_seq(seq)
+, m_items(DYNAMIC_CAST(malSequence, seq))
+, m_index(0)
+{
+    MAL_CHECK(m_items || (seq == mal::nilValue()) || DYNAMIC_CAST(malLazySeq, seq),
+              "%s is not a sequence", seq->print(true).c_str());
+}
+
+bool malIterator::atEnd() const
+{
+    if (m_items) {
+        return m_index >= m_items->count();
+    }
+    return (m_seq == mal::nilValue()) || STATIC_CAST(malLazySeq, m_seq)->isEmpty();
+}
+
+malValuePtr malIterator::value() const
+{
+    return m_items ? m_items->item(m_index)
+                   : STATIC_CAST(malLazySeq, m_seq)->first();
+}
+
+void malIterator::next()
+{
+    if (m_items) {
+        m_index++;
+    }
+    else {
+        m_seq = STATIC_CAST(malLazySeq, m_seq)->rest();
+    }
+}
+
+malValuePtr malIterator::rest() const
+{
+    if (m_items) {
+        return (m_index == 0) ? m_seq
+            : mal::lazySeq(new SequenceGenerator(m_seq, m_index));
+    }
+    return m_seq;
+}
+
+static bool isSymbol(malValuePtr obj, const String& text)
+{
+    const malSymbol* sym = DYNAMIC_CAST(malSymbol, obj);
+    return sym && (sym->value() == text);
+}
+
+//  Return arg when ast matches ('sym, arg), else NULL.
+static malValuePtr starts_with(const malValuePtr ast, const char* sym)
+{
+    const malList* list = DYNAMIC_CAST(malList, ast);
+    if (!list || list->isEmpty() || !isSymbol(list->item(0), sym))
+        return NULL;
+    checkArgsIs(sym, 1, list->count() - 1);
+    return list->item(1);
+}
+
+malQuasiquote::malQuasiquote(malValuePtr form)
+: m_form(form)
+, m_kind(CONSTANT)
+{
+    if (DYNAMIC_CAST(malSymbol, form) || DYNAMIC_CAST(malHash, form))
+        return;
+
+    const malSequence* seq = DYNAMIC_CAST(malSequence, form);
+    if (!seq)
+        return;
+
+    if (starts_with(form, "unquote")) {
+        m_kind = UNQUOTE;
+        return;
+    }
+
+    // A template with nothing unquoted anywhere evaluates to itself.
+    bool isConstant = true;
+    m_parts.reserve(seq->count());
+    for (auto it = seq->begin(), end = seq->end(); it != end; ++it) {
+        const malValuePtr spl_unq = starts_with(*it, "splice-unquote");
+        if (spl_unq) {
+            m_parts.push_back(Part { true, spl_unq });
+            isConstant = false;
+        }
+        else {
+            malQuasiquote* part = new malQuasiquote(*it);
+            m_parts.push_back(Part { false, part });
+            isConstant = isConstant && (part->m_kind == CONSTANT);
+        }
+    }
+    if (isConstant) {
+        m_parts.clear();
+    }
+    else {
+        m_kind = DYNAMIC_CAST(malVector, form) ? VECTOR : LIST;
+    }
+}
+
+malQuasiquote::malQuasiquote(const malQuasiquote& that, malValuePtr meta)
+: malValue(meta)
+, m_form(that.m_form)
+, m_kind(that.m_kind)
+, m_parts(that.m_parts)
+{
+
+}
+
+malValuePtr malQuasiquote::eval(malEnvPtr env)
+{
+    switch (m_kind) {
+        case CONSTANT:
+            return m_form;
+        case UNQUOTE:
+            return EVAL(unquoted(), env);
+        default:
+            break;
+    }
+
+    malValueVec values;
+    values.reserve(m_parts.size());
+    for (auto it = m_parts.begin(), end = m_parts.end(); it != end; ++it) {
+        values.push_back(it->isSplice ? EVAL(it->value, env)
+                                      : it->value->eval(env));
+    }
+    return build(values.begin(), values.end());
+}
+
+malValuePtr malQuasiquote::unquoted() const
+{
+    return STATIC_CAST(malList, m_form)->item(1);
+}
+
+malValuePtr malQuasiquote::build(malValueIter valuesBegin,
+                                 malValueIter valuesEnd) const
+{
+    std::unique_ptr<malValueVec> items(new malValueVec);
+    items->reserve(m_parts.size());
+    auto part = m_parts.begin();
+    for (auto it = valuesBegin; it != valuesEnd; ++it, ++part) {
+        if (!part->isSplice) {
+            items->push_back(*it);
+        }
+        else if (const malSequence* seq = DYNAMIC_CAST(malSequence, *it)) {
+            items->insert(items->end(), seq->begin(), seq->end());
+        }
+        else {
+            for (malIterator item(*it); !item.atEnd(); item.next()) {
+                items->push_back(item.value());
+            }
+        }
+    }
+    return (m_kind == VECTOR) ? mal::vector(items.release())
+                              : mal::list(items.release());
+}
+
+static String expansionText(malValuePtr obj, bool readably)
+{
+    if (DYNAMIC_CAST(malSymbol, obj) || DYNAMIC_CAST(malHash, obj))
+        return "(quote " + obj->print(readably) + ")";
+
+    const malSequence* seq = DYNAMIC_CAST(malSequence, obj);
+    if (!seq)
+        return obj->print(readably);
+
+    const malValuePtr unquoted = starts_with(obj, "unquote");
+    if (unquoted)
+        return unquoted->print(readably);
+
+    String res = "()";
+    for (int i=seq->count()-1; 0<=i; i--) {
+        const malValuePtr elt     = seq->item(i);
+        const malValuePtr spl_unq = starts_with(elt, "splice-unquote");
+        if (spl_unq)
+            res = "(concat " + spl_unq->print(readably) + " " + res + ")";
+        else
+            res = "(cons " + expansionText(elt, readably) + " " + res + ")";
+    }
+    if (DYNAMIC_CAST(malVector, obj))
+        res = "(vec " + res + ")";
+    return res;
+}
+
+String malQuasiquote::print(bool readably) const
+{
+    return expansionText(m_form, readably);
+}
+
 malValuePtr malList::conj(malValueIter argsBegin,
                           malValueIter argsEnd) const
 {
@@ -329,6 +1127,28 @@ malValuePtr malList::conj(malValueIter argsBegin,
     return mal::list(items);
 }
 
+static Atomic<int> s_foldedCount(0);
+
+malValuePtr malList::fold(malValuePtr op) const
+{
+    const malBuiltIn* builtin = DYNAMIC_CAST(malBuiltIn, op);
+    if (!builtin || !builtin->isPure()) {
+        return NULL;
+    }
+    malValuePtr folded = cachedExpansion(op);
+    if (!folded && allLiteral(begin() + 1, end())) {
+        folded = builtin->apply(begin() + 1, end());
+        cacheExpansion(op, folded);
+        s_foldedCount++;
+    }
+    return folded;
+}
+
+int malList::foldedCount()
+{
+    return s_foldedCount;
+}
+
 malValuePtr malList::eval(malEnvPtr env)
 {
     // Note, this isn't actually called since the TCO updates, but
@@ -360,6 +1180,13 @@ bool malValue::isEqualTo(const malValue* rhs) const
     bool matchingTypes = (typeid(*this) == typeid(*rhs)) ||
         (dynamic_cast<const malSequence*>(this) &&
          dynamic_cast<const malSequence*>(rhs));
+    if (!matchingTypes &&
+            mal::isSequential(this) && mal::isSequential(rhs)) {
+        // Lazy sequences can be compared with either of them.
+        const malValue* lazy = dynamic_cast<const malLazySeq*>(this)
+                             ? this : rhs;
+        return lazy->doIsEqualTo(lazy == this ? rhs : this);
+    }
 
     return matchingTypes && doIsEqualTo(rhs);
 }
@@ -380,27 +1207,33 @@ malValuePtr malValue::withMeta(malValuePtr meta) const
     return doWithMeta(meta);
 }
 
+static int64_t itemBytes(const malValueVec* items)
+{
+    return items->capacity() * sizeof(malValuePtr);
+}
+
 malSequence::malSequence(malValueVec* items)
 : m_items(items)
 {
-
+    RuntimeStats::addVectorBytes(itemBytes(m_items));
 }
 
 malSequence::malSequence(malValueIter begin, malValueIter end)
 : m_items(new malValueVec(begin, end))
 {
-
+    RuntimeStats::addVectorBytes(itemBytes(m_items));
 }
 
 malSequence::malSequence(const malSequence& that, malValuePtr meta)
 : malValue(meta)
 , m_items(new malValueVec(*(that.m_items)))
 {
-
+    RuntimeStats::addVectorBytes(itemBytes(m_items));
 }
 
 malSequence::~malSequence()
 {
+    RuntimeStats::addVectorBytes(-itemBytes(m_items));
     delete m_items;
 }
 
@@ -474,6 +1307,20 @@ malValuePtr malSymbol::eval(malEnvPtr env)
     return env->get(value());
 }
 
+malVector::malVector(malValueVec* items)
+: malSequence(items)
+, m_isLiteral(allLiteral(begin(), end()))
+{
+
+}
+
+malVector::malVector(malValueIter begin, malValueIter end)
+: malSequence(begin, end)
+, m_isLiteral(allLiteral(begin, end))
+{
+
+}
+
 malValuePtr malVector::conj(malValueIter argsBegin,
                             malValueIter argsEnd) const
 {
@@ -489,6 +1336,9 @@ malValuePtr malVector::conj(malValueIter argsBegin,
 
 malValuePtr malVector::eval(malEnvPtr env)
 {
+    if (m_isLiteral) {
+        return malValuePtr(this);
+    }
     return mal::vector(evalItems(env));
 }
 
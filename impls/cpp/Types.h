@@ -2,8 +2,10 @@
 #define INCLUDE_TYPES_H
 
 #include "MAL.h"
+#include "RuntimeStats.h"
 
 #include <exception>
+#include <functional>
 #include <map>
 
 class malEmptyInputException : public std::exception { };
@@ -28,8 +30,15 @@ public:
 
     bool isEqualTo(const malValue* rhs) const;
 
+    // Values which are equal have equal hash codes. By default values are
+    // only equal to themselves.
+    virtual size_t hashCode() const;
+
     virtual malValuePtr eval(malEnvPtr env);
 
+    // True for values which evaluate to themselves and can never change.
+    virtual bool isLiteral() const { return false; }
+
     virtual String print(bool readably) const = 0;
 
 protected:
@@ -57,12 +66,16 @@ T* value_cast(malValuePtr obj, const char* typeName) {
 
 class malConstant : public malValue {
 public:
+    COUNTED(malConstant);
+
     malConstant(String name) : m_name(name) { }
     malConstant(const malConstant& that, malValuePtr meta)
         : malValue(meta), m_name(that.m_name) { }
 
     virtual String print(bool readably) const { return m_name; }
 
+    virtual bool isLiteral() const { return true; }
+
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return this == rhs; // these are singletons
     }
@@ -75,6 +88,8 @@ private:
 
 class malInteger : public malValue {
 public:
+    COUNTED(malInteger);
+
     malInteger(int64_t value) : m_value(value) { }
     malInteger(const malInteger& that, malValuePtr meta)
         : malValue(meta), m_value(that.m_value) { }
@@ -85,10 +100,14 @@ public:
 
     int64_t value() const { return m_value; }
 
+    virtual bool isLiteral() const { return true; }
+
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return m_value == static_cast<const malInteger*>(rhs)->m_value;
     }
 
+    virtual size_t hashCode() const;
+
     WITH_META(malInteger);
 
 private:
@@ -104,6 +123,10 @@ public:
 
     virtual String print(bool readably) const { return m_value; }
 
+    virtual bool isLiteral() const { return true; }
+
+    virtual size_t hashCode() const;
+
     String value() const { return m_value; }
 
 private:
@@ -112,6 +135,8 @@ private:
 
 class malString : public malStringBase {
 public:
+    COUNTED(malString);
+
     malString(const String& token)
         : malStringBase(token) { }
     malString(const malString& that, malValuePtr meta)
@@ -130,6 +155,8 @@ public:
 
 class malKeyword : public malStringBase {
 public:
+    COUNTED(malKeyword);
+
     malKeyword(const String& token)
         : malStringBase(token) { }
     malKeyword(const malKeyword& that, malValuePtr meta)
@@ -144,6 +171,8 @@ public:
 
 class malSymbol : public malStringBase {
 public:
+    COUNTED(malSymbol);
+
     malSymbol(const String& token)
         : malStringBase(token) { }
     malSymbol(const malSymbol& that, malValuePtr meta)
@@ -151,6 +180,8 @@ public:
 
     virtual malValuePtr eval(malEnvPtr env);
 
+    virtual bool isLiteral() const { return false; }
+
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return value() == static_cast<const malSymbol*>(rhs)->value();
     }
@@ -176,6 +207,7 @@ public:
     malValueIter end()   const { return m_items->end(); }
 
     virtual bool doIsEqualTo(const malValue* rhs) const;
+    virtual size_t hashCode() const;
 
     virtual malValuePtr conj(malValueIter argsBegin,
                               malValueIter argsEnd) const = 0;
@@ -189,6 +221,8 @@ private:
 
 class malList : public malSequence {
 public:
+    COUNTED(malList);
+
     malList(malValueVec* items) : malSequence(items) { }
     malList(malValueIter begin, malValueIter end)
         : malSequence(begin, end) { }
@@ -198,27 +232,58 @@ public:
     virtual String print(bool readably) const;
     virtual malValuePtr eval(malEnvPtr env);
 
+    virtual bool isLiteral() const { return isEmpty(); }
+
     virtual malValuePtr conj(malValueIter argsBegin,
                              malValueIter argsEnd) const;
 
+    // Constant folding: a call to a pure builtin whose arguments are all
+    // literals is evaluated once, and the result cached on the call site.
+    // Returns NULL if the call can't be folded.
+    malValuePtr fold(malValuePtr op) const;
+    static int foldedCount();
+
+    // EVAL memoises the expansion of a call site on the list itself. The
+    // entry is tagged with the operator which produced it, so rebinding
+    // that operator invalidates the cached expansion.
+    malValuePtr cachedExpansion(malValuePtr expander) const {
+        LockGuard<SpinLock> lock(lockFor(this));
+        return (m_expander == expander) ? m_expansion : malValuePtr();
+    }
+    void cacheExpansion(malValuePtr expander, malValuePtr expansion) const {
+        LockGuard<SpinLock> lock(lockFor(this));
+        m_expander  = expander;
+        m_expansion = expansion;
+    }
+
     WITH_META(malList);
+
+private:
+    mutable malValuePtr m_expander;
+    mutable malValuePtr m_expansion;
 };
 
 class malVector : public malSequence {
 public:
-    malVector(malValueVec* items) : malSequence(items) { }
-    malVector(malValueIter begin, malValueIter end)
-        : malSequence(begin, end) { }
+    COUNTED(malVector);
+
+    malVector(malValueVec* items);
+    malVector(malValueIter begin, malValueIter end);
     malVector(const malVector& that, malValuePtr meta)
-        : malSequence(that, meta) { }
+        : malSequence(that, meta), m_isLiteral(that.m_isLiteral) { }
 
     virtual malValuePtr eval(malEnvPtr env);
     virtual String print(bool readably) const;
 
+    virtual bool isLiteral() const { return m_isLiteral; }
+
     virtual malValuePtr conj(malValueIter argsBegin,
                              malValueIter argsEnd) const;
 
     WITH_META(malVector);
+
+private:
+    const bool m_isLiteral;
 };
 
 class malApplicable : public malValue {
@@ -232,12 +297,15 @@ public:
 
 class malHash : public malValue {
 public:
+    COUNTED(malHash);
+
     typedef std::map<String, malValuePtr> Map;
 
     malHash(malValueIter argsBegin, malValueIter argsEnd, bool isEvaluated);
-    malHash(const malHash::Map& map);
+    malHash(const malHash::Map& map, bool isEvaluated = true);
     malHash(const malHash& that, malValuePtr meta)
-    : malValue(meta), m_map(that.m_map), m_isEvaluated(that.m_isEvaluated) { }
+    : malValue(meta), m_map(that.m_map), m_isEvaluated(that.m_isEvaluated)
+    , m_isLiteral(that.m_isLiteral) { }
 
     malValuePtr assoc(malValueIter argsBegin, malValueIter argsEnd) const;
     malValuePtr dissoc(malValueIter argsBegin, malValueIter argsEnd) const;
@@ -247,28 +315,49 @@ public:
     malValuePtr keys() const;
     malValuePtr values() const;
 
+    // The items keyed by their printed keys, and whether they're evaluated
+    // already, or are a hash-map form in code.
+    const Map& map() const { return m_map; }
+    bool isEvaluated() const { return m_isEvaluated; }
+
     virtual String print(bool readably) const;
 
+    virtual bool isLiteral() const { return m_isLiteral; }
+
     virtual bool doIsEqualTo(const malValue* rhs) const;
+    virtual size_t hashCode() const;
 
     WITH_META(malHash);
 
 private:
     const Map m_map;
     const bool m_isEvaluated;
+    const bool m_isLiteral;
 };
 
 class malBuiltIn : public malApplicable {
 public:
+    COUNTED(malBuiltIn);
+
     typedef malValuePtr (ApplyFunc)(const String& name,
                                     malValueIter argsBegin,
                                     malValueIter argsEnd);
 
-    malBuiltIn(const String& name, ApplyFunc* handler)
-    : m_name(name), m_handler(handler) { }
+    // Builtins registered at runtime may hold state, so take a function
+    // object rather than a plain function.
+    typedef std::function<malValuePtr(const String& name,
+                                      malValueIter argsBegin,
+                                      malValueIter argsEnd)> Function;
+
+    malBuiltIn(const String& name, ApplyFunc* handler, bool isPure = false)
+    : m_name(name), m_handler(handler), m_isPure(isPure) { }
+
+    malBuiltIn(const String& name, const Function& function)
+    : m_name(name), m_handler(NULL), m_function(function), m_isPure(false) { }
 
     malBuiltIn(const malBuiltIn& that, malValuePtr meta)
-    : malApplicable(meta), m_name(that.m_name), m_handler(that.m_handler) { }
+    : malApplicable(meta), m_name(that.m_name), m_handler(that.m_handler)
+    , m_function(that.m_function), m_isPure(that.m_isPure) { }
 
     virtual malValuePtr apply(malValueIter argsBegin,
                               malValueIter argsEnd) const;
@@ -283,15 +372,23 @@ public:
 
     String name() const { return m_name; }
 
+    // Pure builtins have no side effects, and their result depends only on
+    // their arguments, so calls to them may be constant folded.
+    bool isPure() const { return m_isPure; }
+
     WITH_META(malBuiltIn);
 
 private:
     const String m_name;
     ApplyFunc* m_handler;
+    Function m_function; // used when there's no handler
+    const bool m_isPure;
 };
 
 class malLambda : public malApplicable {
 public:
+    COUNTED(malLambda);
+
     malLambda(const StringVec& bindings, malValuePtr body, malEnvPtr env);
     malLambda(const malLambda& that, malValuePtr meta);
     malLambda(const malLambda& that, bool isMacro);
@@ -300,6 +397,8 @@ public:
                               malValueIter argsEnd) const;
 
     malValuePtr getBody() const { return m_body; }
+    const StringVec& getBindings() const { return m_bindings; }
+    malEnvPtr getEnv() const;
     malEnvPtr makeEnv(malValueIter argsBegin, malValueIter argsEnd) const;
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
@@ -312,6 +411,21 @@ public:
 
     bool isMacro() const { return m_isMacro; }
 
+    // The name a lambda is first bound to, for the profiler's reports.
+    String name() const {
+        LockGuard<SpinLock> lock(lockFor(this));
+        return m_name;
+    }
+    void setName(const String& name) const {
+        LockGuard<SpinLock> lock(lockFor(this));
+        if (m_name.empty()) {
+            m_name = name;
+        }
+    }
+
+    // Macros with {:impure true} metadata are re-expanded at every call.
+    bool isImpure() const { return m_isImpure; }
+
     virtual malValuePtr doWithMeta(malValuePtr meta) const;
 
 private:
@@ -319,56 +433,374 @@ private:
     const malValuePtr m_body;
     const malEnvPtr   m_env;
     const bool        m_isMacro;
+    const bool        m_isImpure;
+    mutable String    m_name;
+};
+
+// A contiguous array of integers, for numeric work without a separately
+// allocated malInteger per item. The int-array builtins never modify an
+// array once it's been made.
+class malIntArray : public malValue {
+public:
+    COUNTED(malIntArray);
+
+    typedef std::vector<int64_t> Vec;
+
+    malIntArray(Vec* items) : m_items(items) { }
+    malIntArray(const malIntArray& that, malValuePtr meta)
+    : malValue(meta), m_items(new Vec(*that.m_items)) { }
+    virtual ~malIntArray() { delete m_items; }
+
+    const Vec& items() const { return *m_items; }
+    int count() const { return m_items->size(); }
+
+    virtual String print(bool readably) const;
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return items() == static_cast<const malIntArray*>(rhs)->items();
+    }
+
+    virtual size_t hashCode() const;
+
+    WITH_META(malIntArray);
+
+private:
+    Vec* const m_items;
+};
+
+// The composition of functions, as made by comp. The rightmost function is
+// applied to the arguments, and each of the others to the result of the one
+// after it.
+class malComposition : public malApplicable {
+public:
+    COUNTED(malComposition);
+
+    malComposition(malValueIter begin, malValueIter end)
+    : m_functions(begin, end) { }
+
+    malComposition(const malComposition& that, malValuePtr meta)
+    : malApplicable(meta), m_functions(that.m_functions) { }
+
+    virtual malValuePtr apply(malValueIter argsBegin,
+                              malValueIter argsEnd) const;
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return this == rhs;
+    }
+
+    virtual String print(bool readably) const {
+        return STRF("#composition(%p)", this);
+    }
+
+    const malValueVec& functions() const { return m_functions; }
+
+    WITH_META(malComposition);
+
+private:
+    const malValueVec m_functions;
+};
+
+// A function whose results are cached, keyed on the values of its arguments,
+// as made by memoize. If it has a capacity, the least recently used result is
+// dropped to make room once the cache is full. Copies made by with-meta share
+// the cache of the original.
+class malMemoized : public malApplicable {
+public:
+    COUNTED(malMemoized);
+
+    malMemoized(malValuePtr op, size_t capacity);
+    malMemoized(const malMemoized& that, malValuePtr meta);
+    virtual ~malMemoized();
+
+    virtual malValuePtr apply(malValueIter argsBegin,
+                              malValueIter argsEnd) const;
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return this == rhs;
+    }
+
+    virtual String print(bool readably) const {
+        return STRF("#memoized(%p)", this);
+    }
+
+    malValuePtr op() const { return m_op; }
+    int64_t hits() const;
+    int64_t misses() const;
+    size_t  size() const;
+    size_t  capacity() const; // 0 if unbounded
+
+    WITH_META(malMemoized);
+
+private:
+    class Cache;
+
+    const malValuePtr          m_op;
+    const RefCountedPtr<Cache> m_cache;
+};
+
+// A transformation of reducing functions, as made by the single argument
+// forms of map, filter, remove, keep, take and drop. Transducers combined
+// with comp run all of their steps over each item in turn, without building
+// intermediate collections.
+class malTransducer : public malValue {
+public:
+    COUNTED(malTransducer);
+
+    enum Kind { MAP, FILTER, REMOVE, KEEP, TAKE, DROP };
+
+    struct Step {
+        Kind        kind;
+        malValuePtr op;     // for all but TAKE and DROP
+        int64_t     count;  // for TAKE and DROP
+    };
+    typedef std::vector<Step> StepVec;
+
+    malTransducer(const StepVec& steps) : m_steps(steps) { }
+
+    malTransducer(const malTransducer& that, malValuePtr meta)
+    : malValue(meta), m_steps(that.m_steps) { }
+
+    const StepVec& steps() const { return m_steps; }
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return this == rhs;
+    }
+
+    virtual String print(bool readably) const {
+        return STRF("#transducer(%p)", this);
+    }
+
+    WITH_META(malTransducer);
+
+private:
+    const StepVec m_steps;
+};
+
+// A lazily realised sequence. Its contents are produced by a generator the
+// first time they're needed, and cached from then on. A realised lazy
+// sequence is either empty, or a first item followed by another lazy
+// sequence.
+class malLazySeq : public malValue {
+public:
+    COUNTED(malLazySeq);
+
+    class Generator : public RefCounted {
+    public:
+        // Returns nil, a sequence or another lazy sequence. Generators may
+        // update their own state as they go, but must leave it such that
+        // calling generate() again after an exception still works.
+        virtual malValuePtr generate() = 0;
+    };
+    typedef RefCountedPtr<Generator> GeneratorPtr;
+
+    malLazySeq(Generator* generator);
+    malLazySeq(malValuePtr first, malValuePtr rest);
+    malLazySeq(const malLazySeq& that, malValuePtr meta);
+    virtual ~malLazySeq();
+
+    bool isEmpty() const { realise(); return !m_rest; }
+    malValuePtr first() const;
+    malValuePtr rest() const;
+
+    virtual String print(bool readably) const;
+
+    virtual bool doIsEqualTo(const malValue* rhs) const;
+    virtual size_t hashCode() const;
+
+    WITH_META(malLazySeq);
+
+private:
+    void realise() const;
+
+    mutable Mutex        m_lock;      // held while realising
+    mutable Atomic<bool> m_isRealised;
+    mutable GeneratorPtr m_generator; // NULL once realised
+    mutable malValuePtr  m_first;
+    mutable malValuePtr  m_rest;      // NULL if realised and empty
+};
+
+// Iterates over the items of nil, a sequence or a lazy sequence, realising
+// lazy sequences as it goes.
+class malIterator {
+public:
+    malIterator(malValuePtr seq);
+
+    bool atEnd() const;
+    malValuePtr value() const;
+    void next();
+
+    // The remaining items, as a sequence or lazy sequence.
+    malValuePtr rest() const;
+
+private:
+    malValuePtr        m_seq;
+    const malSequence* m_items; // NULL when iterating a lazy sequence
+    int                m_index;
+};
+
+// A compiled quasiquote template. Evaluating it builds the result directly,
+// evaluating only the unquoted parts, instead of going via cons/concat calls.
+class malQuasiquote : public malValue {
+public:
+    COUNTED(malQuasiquote);
+
+    malQuasiquote(malValuePtr form);
+    malQuasiquote(const malQuasiquote& that, malValuePtr meta);
+
+    virtual malValuePtr eval(malEnvPtr env);
+
+    // Prints the equivalent cons/concat expansion, as seen by DEBUG-EVAL.
+    virtual String print(bool readably) const;
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return this == rhs;
+    }
+
+    WITH_META(malQuasiquote);
+
+    // The step A evaluator evaluates the parts of list and vector templates
+    // on its own stack, so that recursion through them isn't limited by the
+    // C++ stack, then builds the result from their values.
+    enum Kind { CONSTANT, UNQUOTE, LIST, VECTOR };
+
+    Kind kind() const { return m_kind; }
+    malValuePtr constant() const { return m_form; }
+    malValuePtr unquoted() const;
+
+    int  partCount() const { return m_parts.size(); }
+    bool isSplice(int index) const { return m_parts[index].isSplice; }
+    malValuePtr part(int index) const { return m_parts[index].value; }
+
+    // Builds the result from a value for each part, the sequence to splice
+    // for splices.
+    malValuePtr build(malValueIter valuesBegin, malValueIter valuesEnd) const;
+
+private:
+
+    // Each element is either a compiled sub-template, or for splices the
+    // form to be evaluated.
+    struct Part {
+        bool        isSplice;
+        malValuePtr value;
+    };
+
+    const malValuePtr m_form;
+    Kind              m_kind;
+    std::vector<Part> m_parts;
 };
 
 class malAtom : public malValue {
 public:
+    COUNTED(malAtom);
+
     malAtom(malValuePtr value) : m_value(value) { }
     malAtom(const malAtom& that, malValuePtr meta)
-        : malValue(meta), m_value(that.m_value) { }
+        : malValue(meta), m_value(that.deref()) { }
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
-        return this->m_value->isEqualTo(rhs);
+        return deref()->isEqualTo(rhs);
     }
 
     virtual String print(bool readably) const {
-        return "(atom " + m_value->print(readably) + ")";
+        return "(atom " + deref()->print(readably) + ")";
     };
 
-    malValuePtr deref() const { return m_value; }
+    malValuePtr deref() const { return m_value.load(); }
 
-    malValuePtr reset(malValuePtr value) { return m_value = value; }
+    malValuePtr reset(malValuePtr value) {
+        m_value.store(value);
+        return value;
+    }
+
+    // Sets the value, if it's still the one expected, rather than a value
+    // stored by another thread since expected was read.
+    bool compareAndSet(malValuePtr expected, malValuePtr value) {
+        return m_value.compareAndSet(expected, value);
+    }
 
     WITH_META(malAtom);
 
 private:
-    malValuePtr m_value;
+    AtomicRefCountedPtr<malValue> m_value;
+};
+
+// A value which is delivered later: for a future, by a task on the thread
+// pool which calls a function, and for a promise, by deliver. Dereferencing
+// one waits until then, helping to run queued tasks meanwhile.
+class malFuture : public malValue {
+public:
+    COUNTED(malFuture);
+
+    // A NULL thunk makes a promise.
+    malFuture(malValuePtr thunk);
+    malFuture(const malFuture& that, malValuePtr meta);
+    virtual ~malFuture();
+
+    virtual String print(bool readably) const {
+        return STRF("#%s(%p)", m_isPromise ? "promise" : "future", this);
+    }
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return this == rhs;
+    }
+
+    bool isPromise() const { return m_isPromise; }
+    bool isRealised() const;
+
+    // Returns false if a value has already been delivered.
+    bool deliver(malValuePtr value) const;
+
+    // Returns the value, or throws what the future's function threw. Waits
+    // for at most timeoutNs, if it isn't negative, then returns NULL.
+    malValuePtr deref(int64_t timeoutNs) const;
+
+    WITH_META(malFuture);
+
+private:
+    class State;
+
+    const bool                 m_isPromise;
+    const RefCountedPtr<State> m_state;
 };
 
 namespace mal {
     malValuePtr atom(malValuePtr value);
     malValuePtr boolean(bool value);
     malValuePtr builtin(const String& name, malBuiltIn::ApplyFunc handler);
+    malValuePtr builtin(const String& name,
+                        const malBuiltIn::Function& function);
+    malValuePtr composition(malValueIter begin, malValueIter end);
     malValuePtr falseValue();
+    malValuePtr future(malValuePtr thunk);
     malValuePtr hash(malValueIter argsBegin, malValueIter argsEnd,
                      bool isEvaluated);
     malValuePtr hash(const malHash::Map& map);
     malValuePtr integer(int64_t value);
     malValuePtr integer(const String& token);
+    malValuePtr intArray(malIntArray::Vec* items);
     malValuePtr keyword(const String& token);
     malValuePtr lambda(const StringVec&, malValuePtr, malEnvPtr);
+    malValuePtr lazySeq(malLazySeq::Generator* generator);
+    malValuePtr lazySeq(malValuePtr first, malValuePtr rest);
     malValuePtr list(malValueVec* items);
     malValuePtr list(malValueIter begin, malValueIter end);
     malValuePtr list(malValuePtr a);
     malValuePtr list(malValuePtr a, malValuePtr b);
     malValuePtr list(malValuePtr a, malValuePtr b, malValuePtr c);
     malValuePtr macro(const malLambda& lambda);
+    malValuePtr memoized(malValuePtr op, size_t capacity);
     malValuePtr nilValue();
+    malValuePtr promise();
+    malValuePtr quasiquote(malValuePtr form);
     malValuePtr string(const String& token);
     malValuePtr symbol(const String& token);
+    malValuePtr transducer(const malTransducer::StepVec& steps);
     malValuePtr trueValue();
     malValuePtr vector(malValueVec* items);
     malValuePtr vector(malValueIter begin, malValueIter end);
+
+    // True for lists, vectors and lazy sequences.
+    bool isSequential(const malValue* value);
 };
 
 #endif // INCLUDE_TYPES_H
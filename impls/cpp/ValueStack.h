@@ -0,0 +1,80 @@
+#ifndef INCLUDE_VALUESTACK_H
+#define INCLUDE_VALUESTACK_H
+
+#include "MAL.h"
+
+// A stack of values, used by EVAL to hold the evaluated items of calls so
+// that they can be passed to APPLY without allocating a container per call.
+//
+// The stack is made of segments which are never grown past the capacity they
+// were created with, so the iterators handed to a builtin stay valid even if
+// it re-enters EVAL and more values get pushed.
+class ValueStack {
+public:
+    // The values belonging to one frame. These are always contiguous within
+    // a single segment, and only the topmost slice may be pushed to.
+    struct Slice {
+        malValueVec* segment;
+        size_t       index;     // of the segment within the stack
+        size_t       offset;    // of the first value within the segment
+
+        malValueIter begin() const { return segment->begin() + offset; }
+        malValueIter end()   const { return segment->end(); }
+        size_t       size()  const { return segment->size() - offset; }
+
+        void push(const malValuePtr& value) const {
+            segment->push_back(value);
+        }
+    };
+
+    ValueStack() : m_current(0) {
+        m_segments.push_back(newSegment(SEGMENT_SIZE));
+    }
+
+    ~ValueStack() {
+        for (auto it = m_segments.begin(); it != m_segments.end(); ++it) {
+            delete *it;
+        }
+    }
+
+    // Starts a new slice on top of the stack, with room for count values.
+    Slice reserve(size_t count) {
+        malValueVec* segment = m_segments[m_current];
+        if (segment->capacity() - segment->size() < count) {
+            // Segments above the current one are always empty, so can be
+            // replaced if they're too small.
+            if (++m_current == m_segments.size()) {
+                m_segments.push_back(newSegment(count));
+            }
+            else if (m_segments[m_current]->capacity() < count) {
+                delete m_segments[m_current];
+                m_segments[m_current] = newSegment(count);
+            }
+            segment = m_segments[m_current];
+        }
+        return Slice { segment, m_current, segment->size() };
+    }
+
+    // Pops the slice, and everything above it, off the stack.
+    void release(const Slice& slice) {
+        slice.segment->erase(slice.begin(), slice.end());
+        m_current = slice.index;
+    }
+
+private:
+    ValueStack(const ValueStack&); // no copy ctor
+    ValueStack& operator = (const ValueStack&); // no assignments
+
+    enum { SEGMENT_SIZE = 64 * 1024 };
+
+    static malValueVec* newSegment(size_t count) {
+        malValueVec* segment = new malValueVec;
+        segment->reserve(count > SEGMENT_SIZE ? count : SEGMENT_SIZE);
+        return segment;
+    }
+
+    std::vector<malValueVec*> m_segments;
+    size_t                    m_current;
+};
+
+#endif // INCLUDE_VALUESTACK_H
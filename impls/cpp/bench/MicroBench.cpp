@@ -0,0 +1,240 @@
+// Microbenchmarks of the interpreter core, written as JSON to stdout so that
+// results can be compared across commits. Build and run with "make bench".
+//
+// Usage: microbench [--quick] [path to stepA_mal, for the startup benchmark]
+
+#include "MAL.h"
+#include "Environment.h"
+#include "IntKernels.h"
+#include "Types.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <spawn.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
+
+static int64_t s_sampleNs = 200000000;
+static const int s_samples = 5;
+
+static int64_t nowNs()
+{
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(
+        steady_clock::now().time_since_epoch()).count();
+}
+
+struct Result {
+    String  name;
+    int64_t calls;
+    int64_t nsPerCall;
+    int64_t bytesPerCall;   // for throughput, 0 if not applicable
+};
+
+static std::vector<Result> s_results;
+
+//  Calls body in doubling batches until a batch takes a tenth of a sample's
+//  time, then records the median time per call over several such batches.
+template <class Body>
+static void bench(const String& name, int64_t bytesPerCall, Body body)
+{
+    int64_t batch = 1, elapsed = 0;
+    while (1) {
+        const int64_t start = nowNs();
+        for (int64_t i = 0; i < batch; i++) {
+            body();
+        }
+        elapsed = nowNs() - start;
+        if (elapsed >= s_sampleNs / 10) {
+            break;
+        }
+        batch *= 2;
+    }
+    batch = std::max<int64_t>(1,
+        batch * s_sampleNs / std::max<int64_t>(1, elapsed));
+
+    std::vector<int64_t> samples;
+    for (int s = 0; s < s_samples; s++) {
+        const int64_t start = nowNs();
+        for (int64_t i = 0; i < batch; i++) {
+            body();
+        }
+        samples.push_back((nowNs() - start) / batch);
+    }
+    std::sort(samples.begin(), samples.end());
+    s_results.push_back(Result { name, batch * s_samples,
+                                 samples[s_samples / 2], bytesPerCall });
+    std::cerr << name << ": " << samples[s_samples / 2] << " ns\n";
+}
+
+//  A form with a mix of every kind of token the reader handles.
+static String makeSource(int count)
+{
+    String source = "[";
+    for (int i = 0; i < count; i++) {
+        source += STRF("(fn* [a%d] {:key%d \"str\\n%d\" \"%d\" sym-%d} -%d ",
+                       i, i, i, i, i, i);
+        source += "'(1 2 3) `(a ~b ~@c) @atom ^{:m 1} [x] nil true) ";
+    }
+    return source + "]";
+}
+
+static void benchReader()
+{
+    const String source = makeSource(1000);
+    bench("reader", source.size(), [&]() { readStr(source); });
+
+    malValuePtr form = readStr(source);
+    const int64_t bytes = form->print(true).size();
+    bench("printer", bytes, [&]() { form->print(true); });
+}
+
+static void benchEnv()
+{
+    malEnvPtr root(new malEnv);
+    for (int i = 0; i < 100; i++) {
+        root->set(STRF("symbol-%d", i), mal::integer(i));
+    }
+    malEnvPtr inner(new malEnv(malEnvPtr(new malEnv(root))));
+    inner->set("local", mal::integer(0));
+
+    bench("env-get-local", 0, [&]() { inner->get("local"); });
+    bench("env-get-outer", 0, [&]() { inner->get("symbol-50"); });
+
+    malValuePtr value = mal::integer(1);
+    bench("env-set", 0, [&]() { inner->set("local", value); });
+}
+
+static void benchHash()
+{
+    malValueVec items;
+    for (int i = 0; i < 100; i++) {
+        items.push_back(mal::keyword(STRF(":key%d", i)));
+        items.push_back(mal::integer(i));
+    }
+    malValuePtr hash = mal::hash(items.begin(), items.end(), true);
+    const malHash* map = STATIC_CAST(malHash, hash);
+
+    malValueVec pair = { mal::keyword(":new"), mal::integer(1) };
+    bench("hash-assoc", 0, [&]() { map->assoc(pair.begin(), pair.end()); });
+
+    malValuePtr key = mal::keyword(":key50");
+    bench("hash-get", 0, [&]() { map->get(key); });
+}
+
+//  The sequence benchmarks go through the builtins, which is how mal code
+//  sees them.
+static void benchSequences(malEnvPtr env)
+{
+    malValueVec* items = new malValueVec;
+    for (int i = 0; i < 100; i++) {
+        items->push_back(mal::integer(i));
+    }
+    malValuePtr list = mal::list(items);
+    malValueVec listArgs = { list };
+    malValuePtr rest = env->get("rest");
+    bench("list-rest", 0, [&]() {
+        APPLY(rest, listArgs.begin(), listArgs.end());
+    });
+
+    malValueVec consArgs = { mal::integer(0), list };
+    malValuePtr cons = env->get("cons");
+    bench("list-cons", 0, [&]() {
+        APPLY(cons, consArgs.begin(), consArgs.end());
+    });
+
+    const malList* seq = STATIC_CAST(malList, list);
+    malValueVec conjArgs = {
+        mal::vector(seq->begin(), seq->end()), mal::integer(100)
+    };
+    malValuePtr conj = env->get("conj");
+    bench("vector-conj", 0, [&]() {
+        APPLY(conj, conjArgs.begin(), conjArgs.end());
+    });
+}
+
+static void benchEval(malEnvPtr env)
+{
+    rep("(def! fib (fn* [n] (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))",
+        env);
+    rep("(def! sumdown (fn* [n] (if (= n 0) 0 (+ n (sumdown (- n 1))))))",
+        env);
+
+    malValuePtr fib = readStr("(fib 20)");
+    bench("eval-fib-20", 0, [&]() { EVAL(fib, env); });
+
+    malValuePtr sumdown = readStr("(sumdown 1000)");
+    bench("eval-sumdown-1000", 0, [&]() { EVAL(sumdown, env); });
+}
+
+//  Times running a script which does nothing, so it includes loading the
+//  prelude as well as starting the process.
+static void benchStartup(const char* interpreter)
+{
+    if (access(interpreter, X_OK) != 0) {
+        std::cerr << "Skipping startup, can't run " << interpreter << "\n";
+        return;
+    }
+    char* argv[] = {
+        const_cast<char*>(interpreter), const_cast<char*>("/dev/null"), NULL
+    };
+    bench("startup", 0, [&]() {
+        pid_t pid;
+        int status;
+        if (posix_spawn(&pid, interpreter, NULL, NULL, argv, environ) == 0) {
+            waitpid(pid, &status, 0);
+        }
+    });
+}
+
+static void printResults()
+{
+    std::cout << "{\n  \"kernels\": " << escape(intKernelsName())
+              << ",\n  \"benchmarks\": [\n";
+    for (auto it = s_results.begin(); it != s_results.end(); ++it) {
+        std::cout << STRF("    {\"name\": %s, \"calls\": %lld, "
+                          "\"ns_per_call\": %lld",
+                          escape(it->name).c_str(),
+                          (long long)it->calls, (long long)it->nsPerCall);
+        if (it->bytesPerCall > 0) {
+            std::cout << STRF(", \"mb_per_sec\": %.1f",
+                it->bytesPerCall * 1e3 / std::max<int64_t>(1, it->nsPerCall));
+        }
+        std::cout << ((it + 1 == s_results.end()) ? "}\n" : "},\n");
+    }
+    std::cout << "  ]\n}\n";
+}
+
+int main(int argc, char* argv[])
+{
+    const char* interpreter = "./stepA_mal";
+    for (int arg = 1; arg < argc; arg++) {
+        if (strcmp(argv[arg], "--quick") == 0) {
+            s_sampleNs /= 20;
+        }
+        else {
+            interpreter = argv[arg];
+        }
+    }
+
+    malEnvPtr env(new malEnv);
+    installCore(env);
+    try {
+        benchReader();
+        benchEnv();
+        benchHash();
+        benchSequences(env);
+        benchEval(env);
+    }
+    catch (String& s) {
+        std::cerr << "Error: " << s << "\n";
+        return 1;
+    }
+    benchStartup(interpreter);
+    printResults();
+    return 0;
+}
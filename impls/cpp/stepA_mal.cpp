@@ -1,50 +1,260 @@
 #include "MAL.h"
 
 #include "Environment.h"
+#include "Image.h"
+#include "Interpreter.h"
+#include "Profiler.h"
 #include "ReadLine.h"
+#include "RuntimeStats.h"
+#include "Server.h"
+#include "Tracer.h"
 #include "Types.h"
+#include "ValueStack.h"
 
+#include <chrono>
+#include <deque>
 #include <iostream>
 #include <memory>
+#include <string.h>
+#ifdef MAL_THREADS
+#include <pthread.h>
+#endif
+#include <sys/resource.h>
+#include <time.h>
 
 malValuePtr READ(const String& input);
 String PRINT(malValuePtr ast);
-static void installFunctions(malEnvPtr env);
-//  Installs functions, macros and constants implemented in MAL.
-
 static void makeArgv(malEnvPtr env, int argc, char* argv[]);
-static String safeRep(const String& input, malEnvPtr env);
-static malValuePtr quasiquote(malValuePtr obj);
+static String safeRep(const String& input, Interpreter& interpreter);
+static ReadLine& replReadLine();
+
+static size_t s_maxDepth = 2000000;
+
+static void stopProfile(const String& filename);
+static void stopTrace(const String& filename);
+static void printBenchJson(int64_t startNs);
+
+// Re-entrant calls to EVAL, from builtins and macro expansion, still recurse
+// on the C++ stack, so EVAL checks there's room left for them.
+static MAL_THREAD_LOCAL const char* s_stackBase;
+static MAL_THREAD_LOCAL size_t      s_stackLimit;
+static MAL_THREAD_LOCAL bool        s_hasStackLimit;
 
-static ReadLine s_readLine("~/.mal-history");
+static const size_t s_stackMargin = 256 * 1024;
+
+static void initStackLimit(const char* base)
+{
+    s_hasStackLimit = true;
+    struct rlimit limit;
+    if ((getrlimit(RLIMIT_STACK, &limit) == 0) &&
+        (limit.rlim_cur != RLIM_INFINITY) &&
+        (limit.rlim_cur > 2 * s_stackMargin)) {
+        s_stackBase  = base;
+        s_stackLimit = limit.rlim_cur - s_stackMargin;
+    }
+}
 
-static malEnvPtr replEnv(new malEnv);
+#ifdef MAL_THREADS
+// Other threads have stacks of a fixed size, which RLIMIT_STACK only sets a
+// default for, and which is there even when it's unlimited. Where the system
+// says where a thread's stack is, the limit is measured from its top.
+static void initThreadStackLimit(const char* base)
+{
+#ifdef __GLIBC__
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+        void*  address;
+        size_t size;
+        const bool isKnown =
+            (pthread_attr_getstack(&attr, &address, &size) == 0);
+        pthread_attr_destroy(&attr);
+        const char* top = (const char*)address + size;
+        if (isKnown && (size > 2 * s_stackMargin) &&
+            (base > (const char*)address) && (base <= top)) {
+            s_hasStackLimit = true;
+            s_stackBase  = top;
+            s_stackLimit = size - s_stackMargin;
+            return;
+        }
+    }
+#endif
+    initStackLimit(base);
+}
+#endif
+
+static int64_t monotonicNs()
+{
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(
+        steady_clock::now().time_since_epoch()).count();
+}
 
 int main(int argc, char* argv[])
 {
+    const int64_t startNs = monotonicNs();
+    char stackBase;
+    initStackLimit(&stackBase);
     String prompt = "user> ";
     String input;
-    installCore(replEnv);
-    installFunctions(replEnv);
-    makeArgv(replEnv, argc - 2, argv + 2);
-    if (argc > 1) {
-        String filename = escape(argv[1]);
-        safeRep(STRF("(load-file %s)", filename.c_str()), replEnv);
+    int arg = 1;
+    bool isProfiling = false;
+    bool isBenchJson = false;
+    bool isStats = false;
+    String profileFile;
+    String traceFile;
+    String socketPath;
+    String imageFile;
+    for ( ; (arg < argc) && (strncmp(argv[arg], "--", 2) == 0); arg++) {
+        String option = argv[arg];
+        if ((option == "--max-depth") && (arg + 1 < argc)) {
+            s_maxDepth = strtoul(argv[++arg], NULL, 10);
+        }
+        else if (option == "--profile") {
+            isProfiling = true;
+        }
+        else if (option.compare(0, 10, "--profile=") == 0) {
+            isProfiling = true;
+            profileFile = option.substr(10);
+        }
+        else if (option == "--bench-json") {
+            isBenchJson = true;
+        }
+        else if (option == "--stats") {
+            isStats = true;
+        }
+        else if ((option == "--serve") && (arg + 1 < argc)) {
+            socketPath = argv[++arg];
+        }
+        else if ((option == "--image") && (arg + 1 < argc)) {
+            imageFile = argv[++arg];
+        }
+        else if ((option.compare(0, 8, "--trace=") == 0) &&
+                 (option.size() > 8)) {
+            traceFile = option.substr(8);
+        }
+        else {
+            std::cerr << "Unknown option: " << option << "\n";
+            return 1;
+        }
+    }
+    Interpreter interpreter;
+    if (!imageFile.empty()) {
+        try {
+            Image::load(interpreter.env(), imageFile);
+        }
+        catch (String& error) {
+            std::cerr << "Can't load image: " << error << "\n";
+            return 1;
+        }
+    }
+    makeArgv(interpreter.env(), argc - arg - 1, argv + arg + 1);
+    if (isProfiling) {
+        Profiler::start();
+    }
+    if (!traceFile.empty()) {
+        Tracer::start(Tracer::DEFAULT_LAMBDA_THRESHOLD_NS);
+        Profiler::start(Profiler::TRACING);
+    }
+    if ((arg < argc) || !socketPath.empty()) {
+        // The server runs the file first, to load its libraries.
+        if (arg < argc) {
+            String filename = escape(argv[arg]);
+            safeRep(STRF("(load-file %s)", filename.c_str()), interpreter);
+        }
+        if (!socketPath.empty()) {
+            try {
+                Server::serve(interpreter, socketPath);
+            }
+            catch (String& error) {
+                std::cerr << "Can't serve: " << error << "\n";
+                return 1;
+            }
+        }
+        if (isProfiling) {
+            stopProfile(profileFile);
+        }
+        if (!traceFile.empty()) {
+            stopTrace(traceFile);
+        }
+        if (isBenchJson) {
+            printBenchJson(startNs);
+        }
+        if (isStats) {
+            std::cerr << RuntimeStats::report();
+        }
         return 0;
     }
-    rep("(println (str \"Mal [\" *host-language* \"]\"))", replEnv);
-    while (s_readLine.get(prompt, input)) {
-        String out = safeRep(input, replEnv);
+    interpreter.rep("(println (str \"Mal [\" *host-language* \"]\"))");
+    while (replReadLine().get(prompt, input)) {
+        String out = safeRep(input, interpreter);
         if (out.length() > 0)
             std::cout << out << "\n";
     }
+    if (isProfiling) {
+        stopProfile(profileFile);
+    }
+    if (!traceFile.empty()) {
+        stopTrace(traceFile);
+    }
+    if (isStats) {
+        std::cerr << RuntimeStats::report();
+    }
     return 0;
 }
 
-static String safeRep(const String& input, malEnvPtr env)
+//  Prints the profile table to stderr, so it doesn't mix with the program's
+//  output, and writes the folded stacks if there's a file for them.
+static void stopProfile(const String& filename)
+{
+    Profiler::stop();
+    std::cerr << Profiler::report();
+    if (!filename.empty()) {
+        try {
+            Profiler::writeFoldedStacks(filename);
+        }
+        catch (String& s) {
+            std::cerr << "Error: " << s << "\n";
+        }
+    }
+}
+
+//  Prints measurements of the whole run to stderr as a line of JSON, for
+//  the perf regression runner. ru_maxrss is in kilobytes on Linux, but in
+//  bytes on Mac OS X.
+static void printBenchJson(int64_t startNs)
+{
+    struct timespec cpu;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    const long peakRssKb = usage.ru_maxrss / 1024;
+#else
+    const long peakRssKb = usage.ru_maxrss;
+#endif
+    std::cerr << STRF("{\"wall_ns\": %lld, \"cpu_ns\": %lld, "
+                      "\"peak_rss_kb\": %ld, \"allocations\": %lld}\n",
+                      (long long)(monotonicNs() - startNs),
+                      (long long)cpu.tv_sec * 1000000000 + cpu.tv_nsec,
+                      peakRssKb, (long long)RefCounted::allocations());
+}
+
+static void stopTrace(const String& filename)
+{
+    Profiler::stop(Profiler::TRACING);
+    Tracer::stop();
+    try {
+        Tracer::write(filename);
+    }
+    catch (String& s) {
+        std::cerr << "Error: " << s << "\n";
+    }
+}
+
+static String safeRep(const String& input, Interpreter& interpreter)
 {
     try {
-        return rep(input, env);
+        return interpreter.rep(input);
     }
     catch (malEmptyInputException&) {
         return String();
@@ -68,6 +278,7 @@ static void makeArgv(malEnvPtr env, int argc, char* argv[])
 
 String rep(const String& input, malEnvPtr env)
 {
+    Tracer::Span span("eval", "rep", input.substr(0, 80));
     return PRINT(EVAL(READ(input), env));
 }
 
@@ -76,169 +287,593 @@ malValuePtr READ(const String& input)
     return readStr(input);
 }
 
-malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
+// Evaluation runs on an explicit, heap allocated stack of frames rather than
+// recursing on the C++ stack, so deep non-tail recursion is limited only by
+// s_maxDepth. Each frame holds a partially evaluated form which is waiting
+// for the value of one of its sub-forms.
+enum FrameKind {
+    FRAME_CALL,         // evaluating the operator and arguments of a call
+    FRAME_COND,         // cond*, waiting for a test
+    FRAME_DEF,          // def!, waiting for the value
+    FRAME_DEFMACRO,     // defmacro!, waiting for the function
+    FRAME_DO,           // do, evaluating all but the last form
+    FRAME_IF,           // if, waiting for the condition
+    FRAME_LET,          // let*, evaluating the bindings
+    FRAME_QUASIQUOTE,   // evaluating the parts of a quasiquote template
+    FRAME_TRY,          // try*, catches exceptions thrown by its body
+    FRAME_VECTOR,       // evaluating the items of a vector
+};
+
+struct Frame {
+    Frame(FrameKind kind, malValuePtr form, malEnvPtr env, int index)
+    : kind(kind), index(index), form(form), env(env) {
+        values.segment = NULL;
+    }
+
+    FrameKind   kind;
+    int         index;  // the sub-form being evaluated, for cond*, do and let*
+    malValuePtr form;
+    malEnvPtr   env;
+    ValueStack::Slice values; // evaluated items, for calls and vectors
+};
+
+// Each thread evaluates on stacks of its own.
+static MAL_THREAD_LOCAL std::deque<Frame> s_frames;
+static MAL_THREAD_LOCAL ValueStack        s_values;
+
+static void pushFrame(FrameKind kind, malValuePtr form, malEnvPtr env,
+                      int index = 0)
 {
-    if (!env) {
-        env = replEnv;
+    MAL_CHECK(s_frames.size() < s_maxDepth,
+              "Maximum evaluation depth of %zu exceeded", s_maxDepth);
+    s_frames.emplace_back(kind, form, env, index);
+}
+
+//  Pushes a call or vector frame, with room for the values of its items.
+static Frame& pushItemsFrame(FrameKind kind, malValuePtr form, malEnvPtr env)
+{
+    pushFrame(kind, form, env);
+    Frame& frame = s_frames.back();
+    frame.values = s_values.reserve(STATIC_CAST(malSequence, form)->count());
+    return frame;
+}
+
+static void popFrame()
+{
+    Frame& frame = s_frames.back();
+    if (frame.values.segment) {
+        s_values.release(frame.values);
     }
-    while (1) {
+    s_frames.pop_back();
+}
+
+static bool isDebugEval(const malEnvPtr& env)
+{
+    static const String debugEval("DEBUG-EVAL");
+    const malEnvPtr dbgenv = env->find(debugEval);
+    return dbgenv && dbgenv->get(debugEval)->isTrue();
+}
+
+//  Evaluates forms which don't need a frame of their own, returning NULL for
+//  lists and vectors.
+static malValuePtr evalSimple(const malValuePtr& ast, const malEnvPtr& env,
+                              bool debug)
+{
+    if (DYNAMIC_CAST(malSequence, ast) && !ast->isLiteral()) {
+        return NULL;
+    }
+    if (debug) {
+        std::cout << "EVAL: " << PRINT(ast) << "\n";
+    }
+    return ast->isLiteral() ? ast : ast->eval(env);
+}
+
+//  Evaluates the remaining items of a call or vector frame. Returns false,
+//  with ast and env set up, at the first item which needs its own frame.
+static bool evalItems(Frame& frame, malValuePtr& ast, malEnvPtr& env)
+{
+    const malSequence* seq = STATIC_CAST(malSequence, frame.form);
+    const bool debug = isDebugEval(frame.env);
+    for (int i = frame.values.size(), count = seq->count(); i < count; i++) {
+        malValuePtr item = seq->item(i);
+        malValuePtr value = evalSimple(item, frame.env, debug);
+        if (!value) {
+            ast = item;
+            env = frame.env;
+            return false;
+        }
+        frame.values.push(value);
+    }
+    return true;
+}
+
+static malValuePtr makeVector(Frame& frame)
+{
+    malValuePtr vector = mal::vector(frame.values.begin(), frame.values.end());
+    popFrame();
+    return vector;
+}
 
-       const malEnvPtr dbgenv = env->find("DEBUG-EVAL");
-       if (dbgenv && dbgenv->get("DEBUG-EVAL")->isTrue()) {
-           std::cout << "EVAL: " << PRINT(ast) << "\n";
-       }
+static malValuePtr startQuasiquote(malValuePtr qqValue,
+                                   malValuePtr& ast, malEnvPtr& env);
 
-        const malList* list = DYNAMIC_CAST(malList, ast);
-        if (!list || (list->count() == 0)) {
-            return ast->eval(env);
+//  Evaluates the remaining parts of a quasiquote template's frame, then
+//  builds the result. Returns NULL, with ast and env set up, at the first
+//  part which needs evaluating on the stack.
+static malValuePtr evalQuasiquoteParts(Frame& frame,
+                                       malValuePtr& ast, malEnvPtr& env)
+{
+    const malQuasiquote* qq = STATIC_CAST(malQuasiquote, frame.form);
+    for (int i = frame.values.size(), count = qq->partCount();
+         i < count; i++) {
+        env = frame.env;
+        if (qq->isSplice(i)) {
+            ast = qq->part(i);
+            return NULL;
+        }
+        malValuePtr value = startQuasiquote(qq->part(i), ast, env);
+        if (!value) {
+            return NULL;
         }
+        frame.values.push(value);
+    }
+    malValuePtr value = qq->build(frame.values.begin(), frame.values.end());
+    popFrame();
+    return value;
+}
 
-        // From here on down we are evaluating a non-empty list.
-        // First handle the special forms.
-        if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0))) {
-            String special = symbol->value();
-            int argCount = list->count() - 1;
+//  Starts evaluating a compiled quasiquote template, as evalForm does forms.
+static malValuePtr startQuasiquote(malValuePtr qqValue,
+                                   malValuePtr& ast, malEnvPtr& env)
+{
+    const malQuasiquote* qq = STATIC_CAST(malQuasiquote, qqValue);
+    switch (qq->kind()) {
+        case malQuasiquote::CONSTANT:
+            return qq->constant();
+        case malQuasiquote::UNQUOTE:
+            ast = qq->unquoted();
+            return NULL; // TCO
+        default:
+            break;
+    }
+    pushFrame(FRAME_QUASIQUOTE, qqValue, env);
+    Frame& frame = s_frames.back();
+    frame.values = s_values.reserve(qq->partCount());
+    return evalQuasiquoteParts(frame, ast, env);
+}
 
-            if (special == "def!") {
-                checkArgsIs("def!", 2, argCount);
-                const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
-                return env->set(id->value(), EVAL(list->item(2), env));
+static void nameLambda(malValuePtr value, const malSymbol* id)
+{
+    if (const malLambda* lambda = DYNAMIC_CAST(malLambda, value)) {
+        lambda->setName(id->value());
+    }
+}
+
+//  Applies a call frame once all of its items have been evaluated.
+static malValuePtr applyCall(Frame& frame, malValuePtr& ast, malEnvPtr& env)
+{
+    malValuePtr op = *frame.values.begin();
+    if (const malLambda* lambda = DYNAMIC_CAST(malLambda, op)) {
+        env = lambda->makeEnv(frame.values.begin()+1, frame.values.end());
+        ast = lambda->getBody();
+        popFrame();
+        Profiler::enterTail(op, s_frames.size());
+        return NULL; // TCO
+    }
+    malValuePtr value = APPLY(op, frame.values.begin()+1, frame.values.end());
+    popFrame();
+    return value;
+}
+
+//  Ends a cond* once there are no more pairs of tests and values to try. It
+//  throws, as the cond macro which expanded into nested ifs used to, if the
+//  last test had no value.
+static malValuePtr condEnd(int remaining)
+{
+    if (remaining == 1) {
+        throw mal::string("odd number of forms to cond");
+    }
+    return mal::nilValue();
+}
+
+//  Passes a value to the frame on top of the stack which was waiting for it.
+//  Returns the value of that frame if it is now complete, otherwise sets up
+//  ast and env with the next form to evaluate, and returns NULL.
+static malValuePtr resume(malValuePtr value, malValuePtr& ast, malEnvPtr& env)
+{
+    Frame& frame = s_frames.back();
+    if (frame.kind == FRAME_QUASIQUOTE) {
+        // Check what's spliced now, as the template did before.
+        const malQuasiquote* qq = STATIC_CAST(malQuasiquote, frame.form);
+        if (qq->isSplice(frame.values.size())) {
+            malIterator check(value);
+        }
+        frame.values.push(value);
+        return evalQuasiquoteParts(frame, ast, env);
+    }
+    const malSequence* form = STATIC_CAST(malSequence, frame.form);
+
+    switch (frame.kind) {
+        case FRAME_CALL: {
+            if (frame.values.size() == 0) {
+                // The operator has been evaluated, check for macros and
+                // constant folding before evaluating the arguments.
+                const malList* list = STATIC_CAST(malList, frame.form);
+                const malLambda* lambda = DYNAMIC_CAST(malLambda, value);
+                if (lambda && lambda->isMacro()) {
+                    malValuePtr expansion = list->cachedExpansion(value);
+                    if (!expansion) {
+                        Profiler::Scope scope(value, Profiler::MACRO);
+                        Tracer::Span span("macro", lambda->name());
+                        expansion = EVAL(lambda->getBody(),
+                            lambda->makeEnv(list->begin()+1, list->end()));
+                        if (!lambda->isImpure()) {
+                            list->cacheExpansion(value, expansion);
+                        }
+                    }
+                    ast = expansion;
+                    env = frame.env;
+                    popFrame();
+                    return NULL; // TCO
+                }
+                if (malValuePtr folded = list->fold(value)) {
+                    popFrame();
+                    return folded;
+                }
             }
+            frame.values.push(value);
+            if (!evalItems(frame, ast, env)) {
+                return NULL;
+            }
+            return applyCall(frame, ast, env);
+        }
 
-            if (special == "defmacro!") {
-                checkArgsIs("defmacro!", 2, argCount);
+        case FRAME_COND: {
+            env = frame.env;
+            if (value->isTrue()) {
+                ast = form->item(frame.index + 1);
+                popFrame();
+                return NULL; // TCO
+            }
+            frame.index += 2;
+            const int remaining = form->count() - frame.index;
+            if (remaining < 2) {
+                popFrame();
+                return condEnd(remaining);
+            }
+            ast = form->item(frame.index);
+            return NULL;
+        }
 
-                const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
-                malValuePtr body = EVAL(list->item(2), env);
-                const malLambda* lambda = VALUE_CAST(malLambda, body);
-                return env->set(id->value(), mal::macro(*lambda));
+        case FRAME_DEF: {
+            const malSymbol* id = STATIC_CAST(malSymbol, form->item(1));
+            nameLambda(value, id);
+            value = frame.env->set(id->value(), value);
+            popFrame();
+            return value;
+        }
+
+        case FRAME_DEFMACRO: {
+            const malSymbol* id = STATIC_CAST(malSymbol, form->item(1));
+            const malLambda* lambda = VALUE_CAST(malLambda, value);
+            lambda->setName(id->value());
+            value = frame.env->set(id->value(), mal::macro(*lambda));
+            popFrame();
+            return value;
+        }
+
+        case FRAME_DO: {
+            int index = ++frame.index;
+            ast = form->item(index);
+            env = frame.env;
+            if (index == form->count() - 1) {
+                popFrame();
             }
+            return NULL; // TCO for the last form
+        }
 
-            if (special == "do") {
-                checkArgsAtLeast("do", 1, argCount);
+        case FRAME_IF: {
+            bool isTrue = value->isTrue();
+            if (!isTrue && (form->count() == 3)) {
+                popFrame();
+                return mal::nilValue();
+            }
+            ast = form->item(isTrue ? 2 : 3);
+            env = frame.env;
+            popFrame();
+            return NULL; // TCO
+        }
 
-                for (int i = 1; i < argCount; i++) {
-                    EVAL(list->item(i), env);
-                }
-                ast = list->item(argCount);
-                continue; // TCO
+        case FRAME_LET: {
+            const malSequence* bindings =
+                STATIC_CAST(malSequence, form->item(1));
+            const malSymbol* var =
+                STATIC_CAST(malSymbol, bindings->item(frame.index));
+            nameLambda(value, var);
+            frame.env->set(var->value(), value);
+            frame.index += 2;
+            env = frame.env;
+            if (frame.index < bindings->count()) {
+                VALUE_CAST(malSymbol, bindings->item(frame.index));
+                ast = bindings->item(frame.index + 1);
+                return NULL;
             }
+            ast = form->item(2);
+            popFrame();
+            return NULL; // TCO
+        }
 
-            if (special == "fn*") {
-                checkArgsIs("fn*", 2, argCount);
+        case FRAME_TRY:
+            popFrame();
+            return value;
 
-                const malSequence* bindings =
-                    VALUE_CAST(malSequence, list->item(1));
-                StringVec params;
-                for (int i = 0; i < bindings->count(); i++) {
-                    const malSymbol* sym =
-                        VALUE_CAST(malSymbol, bindings->item(i));
-                    params.push_back(sym->value());
-                }
+        case FRAME_QUASIQUOTE:
+            break; // handled above
+
+        case FRAME_VECTOR:
+            frame.values.push(value);
+            if (!evalItems(frame, ast, env)) {
+                return NULL;
+            }
+            return makeVector(frame);
+    }
+    ASSERT(false, "Unknown frame kind %d\n", frame.kind);
+    return NULL;
+}
+
+//  Starts evaluating ast. Returns its value if that can be done immediately,
+//  otherwise pushes any frames needed, sets up ast and env with the next form
+//  to evaluate, and returns NULL.
+static malValuePtr evalForm(malValuePtr& ast, malEnvPtr& env)
+{
+    const bool debug = isDebugEval(env);
+    if (debug) {
+        std::cout << "EVAL: " << PRINT(ast) << "\n";
+    }
+
+    const malList* list = DYNAMIC_CAST(malList, ast);
+    if (!list || (list->count() == 0)) {
+        if (DYNAMIC_CAST(malVector, ast) && !ast->isLiteral()) {
+            Frame& frame = pushItemsFrame(FRAME_VECTOR, ast, env);
+            if (!evalItems(frame, ast, env)) {
+                return NULL;
+            }
+            return makeVector(frame);
+        }
+        return ast->eval(env);
+    }
 
-                return mal::lambda(params, list->item(2), env);
+    // From here on down we are evaluating a non-empty list.
+    // First handle the special forms.
+    if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0))) {
+        String special = symbol->value();
+        int argCount = list->count() - 1;
+
+        // The cond macro expands to cond*, which tries each test in turn,
+        // rather than to an if for each test with a cond in its else.
+        if (special == "cond*") {
+            if (argCount < 2) {
+                return condEnd(argCount);
             }
+            pushFrame(FRAME_COND, ast, env, 1);
+            ast = list->item(1);
+            return NULL;
+        }
 
-            if (special == "if") {
-                checkArgsBetween("if", 2, 3, argCount);
+        if (special == "def!") {
+            checkArgsIs("def!", 2, argCount);
+            VALUE_CAST(malSymbol, list->item(1));
+            pushFrame(FRAME_DEF, ast, env);
+            ast = list->item(2);
+            return NULL;
+        }
 
-                bool isTrue = EVAL(list->item(1), env)->isTrue();
-                if (!isTrue && (argCount == 2)) {
-                    return mal::nilValue();
-                }
-                ast = list->item(isTrue ? 2 : 3);
-                continue; // TCO
+        if (special == "defmacro!") {
+            checkArgsIs("defmacro!", 2, argCount);
+            VALUE_CAST(malSymbol, list->item(1));
+            pushFrame(FRAME_DEFMACRO, ast, env);
+            ast = list->item(2);
+            return NULL;
+        }
+
+        if (special == "do") {
+            checkArgsAtLeast("do", 1, argCount);
+            if (argCount > 1) {
+                pushFrame(FRAME_DO, ast, env, 1);
             }
+            ast = list->item(1);
+            return NULL;
+        }
 
-            if (special == "let*") {
-                checkArgsIs("let*", 2, argCount);
-                const malSequence* bindings =
-                    VALUE_CAST(malSequence, list->item(1));
-                int count = checkArgsEven("let*", bindings->count());
-                malEnvPtr inner(new malEnv(env));
-                for (int i = 0; i < count; i += 2) {
-                    const malSymbol* var =
-                        VALUE_CAST(malSymbol, bindings->item(i));
-                    inner->set(var->value(), EVAL(bindings->item(i+1), inner));
-                }
+        if (special == "fn*") {
+            checkArgsIs("fn*", 2, argCount);
+
+            const malSequence* bindings =
+                VALUE_CAST(malSequence, list->item(1));
+            StringVec params;
+            for (int i = 0; i < bindings->count(); i++) {
+                const malSymbol* sym =
+                    VALUE_CAST(malSymbol, bindings->item(i));
+                params.push_back(sym->value());
+            }
+
+            return mal::lambda(params, list->item(2), env);
+        }
+
+        if (special == "if") {
+            checkArgsBetween("if", 2, 3, argCount);
+            pushFrame(FRAME_IF, ast, env);
+            ast = list->item(1);
+            return NULL;
+        }
+
+        if (special == "let*") {
+            checkArgsIs("let*", 2, argCount);
+            const malSequence* bindings =
+                VALUE_CAST(malSequence, list->item(1));
+            int count = checkArgsEven("let*", bindings->count());
+            malEnvPtr inner(new malEnv(env));
+            if (count == 0) {
                 ast = list->item(2);
                 env = inner;
-                continue; // TCO
+                return NULL; // TCO
             }
+            VALUE_CAST(malSymbol, bindings->item(0));
+            pushFrame(FRAME_LET, ast, inner);
+            ast = bindings->item(1);
+            env = inner;
+            return NULL;
+        }
 
-            if (special == "quasiquote") {
-                checkArgsIs("quasiquote", 1, argCount);
-                ast = quasiquote(list->item(1));
-                continue; // TCO
+        if (special == "quasiquote") {
+            checkArgsIs("quasiquote", 1, argCount);
+            malValuePtr expansion = list->cachedExpansion(list->item(0));
+            if (!expansion) {
+                expansion = mal::quasiquote(list->item(1));
+                list->cacheExpansion(list->item(0), expansion);
             }
-
-            if (special == "quote") {
-                checkArgsIs("quote", 1, argCount);
-                return list->item(1);
+            if (debug) {
+                std::cout << "EVAL: " << PRINT(expansion) << "\n";
             }
+            return startQuasiquote(expansion, ast, env);
+        }
 
-            if (special == "try*") {
-                malValuePtr tryBody = list->item(1);
+        if (special == "quote") {
+            checkArgsIs("quote", 1, argCount);
+            return list->item(1);
+        }
 
-                if (argCount == 1) {
-                    ast = tryBody;
-                    continue; // TCO
-                }
-                checkArgsIs("try*", 2, argCount);
-                const malList* catchBlock = VALUE_CAST(malList, list->item(2));
+        if (special == "try*") {
+            malValuePtr tryBody = list->item(1);
 
-                checkArgsIs("catch*", 2, catchBlock->count() - 1);
-                MAL_CHECK(VALUE_CAST(malSymbol,
-                    catchBlock->item(0))->value() == "catch*",
-                    "catch block must begin with catch*");
+            if (argCount == 1) {
+                ast = tryBody;
+                return NULL; // TCO
+            }
+            checkArgsIs("try*", 2, argCount);
+            const malList* catchBlock = VALUE_CAST(malList, list->item(2));
+
+            checkArgsIs("catch*", 2, catchBlock->count() - 1);
+            MAL_CHECK(VALUE_CAST(malSymbol,
+                catchBlock->item(0))->value() == "catch*",
+                "catch block must begin with catch*");
+
+            // We don't need excSym at this scope, but we want to check
+            // that the catch block is valid always, not just in case of
+            // an exception.
+            VALUE_CAST(malSymbol, catchBlock->item(1));
+
+            pushFrame(FRAME_TRY, ast, env);
+            ast = tryBody;
+            return NULL;
+        }
+    }
 
-                // We don't need excSym at this scope, but we want to check
-                // that the catch block is valid always, not just in case of
-                // an exception.
-                const malSymbol* excSym =
-                    VALUE_CAST(malSymbol, catchBlock->item(1));
+    // Now we're left with the case of a regular list to be evaluated.
+    pushItemsFrame(FRAME_CALL, ast, env);
+    malValuePtr op = evalSimple(list->item(0), env, debug);
+    if (!op) {
+        ast = list->item(0);
+        return NULL;
+    }
+    return resume(op, ast, env);
+}
 
-                malValuePtr excVal;
+//  Runs the evaluator until the stack is back down to base.
+static malValuePtr run(malValuePtr ast, malEnvPtr env, size_t base)
+{
+    while (1) {
+        malValuePtr value = evalForm(ast, env);
+        while (value) {
+            Profiler::returnTo(s_frames.size());
+            if (s_frames.size() == base) {
+                return value;
+            }
+            value = resume(value, ast, env);
+        }
+    }
+}
 
-                try {
-                    return EVAL(tryBody, env);
-                }
-                catch(String& s) {
-                    excVal = mal::string(s);
-                }
-                catch (malEmptyInputException&) {
-                    // Not an error, continue as if we got nil
-                    ast = mal::nilValue();
-                }
-                catch(malValuePtr& o) {
-                    excVal = o;
-                };
-
-                if (excVal) {
-                    // we got some exception
-                    env = malEnvPtr(new malEnv(env));
-                    env->set(excSym->value(), excVal);
-                    ast = catchBlock->item(2);
-                }
-                continue; // TCO
+//  Pops frames down to the innermost try* above base. Returns false if there
+//  isn't one, otherwise sets up ast and env to evaluate its catch block.
+static bool unwind(size_t base, malValuePtr excVal,
+                   malValuePtr& ast, malEnvPtr& env)
+{
+    while (s_frames.size() > base) {
+        Frame& frame = s_frames.back();
+        if (frame.kind == FRAME_TRY) {
+            if (excVal) {
+                const malList* catchBlock = STATIC_CAST(malList,
+                    STATIC_CAST(malList, frame.form)->item(2));
+                const malSymbol* excSym =
+                    STATIC_CAST(malSymbol, catchBlock->item(1));
+                env = malEnvPtr(new malEnv(frame.env));
+                env->set(excSym->value(), excVal);
+                ast = catchBlock->item(2);
+            }
+            else {
+                // Not an error, continue as if we got nil
+                env = frame.env;
+                ast = mal::nilValue();
             }
+            popFrame();
+            Profiler::unwindTo(s_frames.size());
+            return true;
         }
+        popFrame();
+    }
+    Profiler::returnTo(base);
+    return false;
+}
 
-        // Now we're left with the case of a regular list to be evaluated.
-        malValuePtr op = EVAL(list->item(0), env);
-        if (const malLambda* lambda = DYNAMIC_CAST(malLambda, op)) {
-            if (lambda->isMacro()) {
-                ast = lambda->apply(list->begin()+1, list->end());
-                continue; // TCO
+malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
+{
+    if (!env) {
+        env = Interpreter::currentEnv();
+        MAL_CHECK(env, "There is no interpreter to evaluate in");
+    }
+    // A safe point for threaded builds to free objects which other threads
+    // have dropped.
+    RefCounted::mergeQueued();
+    char stackTop;
+#ifdef MAL_THREADS
+    // Threads other than the main one find their limit on their first
+    // evaluation. Those whose bounds aren't known measure their stack from
+    // the outermost evaluation they've run.
+    if (!s_hasStackLimit || (s_stackBase && (&stackTop > s_stackBase))) {
+        initThreadStackLimit(&stackTop);
+    }
+#endif
+    MAL_CHECK(!s_stackBase || (size_t)(s_stackBase - &stackTop) < s_stackLimit,
+              "Stack overflow in nested evaluation");
+    const size_t base = s_frames.size();
+    while (1) {
+        try {
+            return run(ast, env, base);
+        }
+        catch (String& s) {
+            if (!unwind(base, mal::string(s), ast, env)) {
+                throw;
             }
-            malValueVec* items = STATIC_CAST(malList, list->rest())->evalItems(env);
-            ast = lambda->getBody();
-            env = lambda->makeEnv(items->begin(), items->end());
-            continue; // TCO
         }
-        else {
-            malValueVec* items = STATIC_CAST(malList, list->rest())->evalItems(env);
-            return APPLY(op, items->begin(), items->end());
+        catch (malEmptyInputException&) {
+            if (!unwind(base, NULL, ast, env)) {
+                throw;
+            }
+        }
+        catch (malValuePtr& o) {
+            if (!unwind(base, o, ast, env)) {
+                throw;
+            }
+        }
+        catch (...) {
+            // Other exceptions, from C++ functions defined by embedders,
+            // can't be caught by try*, but their frames must still go.
+            while (s_frames.size() > base) {
+                popFrame();
+            }
+            Profiler::returnTo(base);
+            throw;
         }
     }
 }
@@ -257,68 +892,19 @@ malValuePtr APPLY(malValuePtr op, malValueIter argsBegin, malValueIter argsEnd)
     return handler->apply(argsBegin, argsEnd);
 }
 
-static bool isSymbol(malValuePtr obj, const String& text)
-{
-    const malSymbol* sym = DYNAMIC_CAST(malSymbol, obj);
-    return sym && (sym->value() == text);
-}
-
-//  Return arg when ast matches ('sym, arg), else NULL.
-static malValuePtr starts_with(const malValuePtr ast, const char* sym)
-{
-    const malList* list = DYNAMIC_CAST(malList, ast);
-    if (!list || list->isEmpty() || !isSymbol(list->item(0), sym))
-        return NULL;
-    checkArgsIs(sym, 1, list->count() - 1);
-    return list->item(1);
-}
-
-static malValuePtr quasiquote(malValuePtr obj)
+//  Opened on first use, so that programs which embed the interpreter don't
+//  read the history unless they read lines.
+static ReadLine& replReadLine()
 {
-    if (DYNAMIC_CAST(malSymbol, obj) || DYNAMIC_CAST(malHash, obj))
-        return mal::list(mal::symbol("quote"), obj);
-
-    const malSequence* seq = DYNAMIC_CAST(malSequence, obj);
-    if (!seq)
-        return obj;
-
-    const malValuePtr unquoted = starts_with(obj, "unquote");
-    if (unquoted)
-        return unquoted;
-
-    malValuePtr res = mal::list(new malValueVec(0));
-    for (int i=seq->count()-1; 0<=i; i--) {
-        const malValuePtr elt     = seq->item(i);
-        const malValuePtr spl_unq = starts_with(elt, "splice-unquote");
-        if (spl_unq)
-            res = mal::list(mal::symbol("concat"), spl_unq, res);
-         else
-            res = mal::list(mal::symbol("cons"), quasiquote(elt), res);
-    }
-    if (DYNAMIC_CAST(malVector, obj))
-        res = mal::list(mal::symbol("vec"), res);
-    return res;
-}
-
-static const char* malFunctionTable[] = {
-    "(defmacro! cond (fn* (& xs) (if (> (count xs) 0) (list 'if (first xs) (if (> (count xs) 1) (nth xs 1) (throw \"odd number of forms to cond\")) (cons 'cond (rest (rest xs)))))))",
-    "(def! not (fn* (cond) (if cond false true)))",
-    "(def! load-file (fn* (filename) \
-        (eval (read-string (str \"(do \" (slurp filename) \"\nnil)\")))))",
-    "(def! *host-language* \"C++\")",
-};
-
-static void installFunctions(malEnvPtr env) {
-    for (auto &function : malFunctionTable) {
-        rep(function, env);
-    }
+    static ReadLine readLine("~/.mal-history");
+    return readLine;
 }
 
 // Added to keep the linker happy at step A
 malValuePtr readline(const String& prompt)
 {
     String input;
-    if (s_readLine.get(prompt, input)) {
+    if (replReadLine().get(prompt, input)) {
         return mal::string(input);
     }
     return mal::nilValue();
@@ -0,0 +1,299 @@
+// Tests of the embedding API and of images, which the step tests can't
+// reach. Build and run with "make check"; prints the checks which fail, and
+// exits with 1 if there are any.
+
+#include "Image.h"
+#include "Interpreter.h"
+
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <unistd.h>
+
+#ifdef MAL_THREADS
+#include <thread>
+#endif
+
+static int s_failures = 0;
+
+#define CHECK(condition) \
+    check(condition, #condition, __LINE__)
+
+static void check(bool condition, const char* text, int line)
+{
+    if (!condition) {
+        std::cout << "FAILED line " << line << ": " << text << "\n";
+        s_failures++;
+    }
+}
+
+// The message of the error which evaluating source throws, or "" if none.
+static String errorOf(Interpreter& interpreter, const String& source)
+{
+    try {
+        interpreter.eval(source);
+    }
+    catch (String& error) {
+        return error;
+    }
+    return "";
+}
+
+static int64_t twice(int64_t x)
+{
+    return 2 * x;
+}
+
+static void testTeardown()
+{
+    const int64_t envs = Counted<malEnv>::live();
+    const int64_t lambdas = Counted<malLambda>::live();
+    for (int i = 0; i < 3; i++) {
+        Interpreter interpreter;
+        interpreter.eval("(def! f (fn* [x] x))");
+        interpreter.eval("(def! a (atom f))");
+        CHECK(interpreter.eval("(f 1)")->print(true) == "1");
+    }
+    CHECK(Counted<malEnv>::live() == envs);
+    CHECK(Counted<malLambda>::live() == lambdas);
+}
+
+static void testForeignExceptions()
+{
+    Interpreter interpreter;
+    interpreter.define("boom", [](int64_t x) -> int64_t {
+        throw std::runtime_error("boom");
+    });
+    const int64_t envs = Counted<malEnv>::live();
+    const int64_t vectors = Counted<malVector>::live();
+    for (int i = 0; i < 3; i++) {
+        bool isThrown = false;
+        try {
+            interpreter.eval("(let* [big (vec (range 0 1000))]"
+                             "  (+ 1 (boom 1)))");
+        }
+        catch (std::runtime_error&) {
+            isThrown = true;
+        }
+        CHECK(isThrown);
+    }
+    CHECK(Counted<malEnv>::live() == envs);
+    CHECK(Counted<malVector>::live() == vectors);
+    CHECK(interpreter.eval("(+ 1 2)")->print(true) == "3");
+}
+
+static void testScripts()
+{
+    Interpreter interpreter;
+    Interpreter::Script script = interpreter.compile(
+        "(def! total (fn* [xs] (reduce + 0 xs)))\n"
+        "(total [1 2 3]) ; a comment on the last line");
+    CHECK(interpreter.run<int64_t>(script) == 6);
+    CHECK(interpreter.run<int64_t>(script) == 6);
+    CHECK(interpreter.run(interpreter.compile("")) == mal::nilValue());
+
+    bool isThrown = false;
+    try {
+        interpreter.run(Interpreter::Script());
+    }
+    catch (String& error) {
+        isThrown = (error == "The script has not been compiled");
+    }
+    CHECK(isThrown);
+
+    std::vector<int64_t> items { 4, 5, 6 };
+    CHECK(interpreter.call<int64_t>("total", items) == 15);
+    CHECK(interpreter.call<int64_t>(interpreter.eval("total"),
+                                    std::vector<int>()) == 0);
+    CHECK(interpreter.call<String>("str", "a", 1, true) == "a1true");
+    CHECK(interpreter.call<std::vector<String> >("vector", "x", "y") ==
+          std::vector<String>({ "x", "y" }));
+}
+
+static void testDefine()
+{
+    Interpreter interpreter;
+    interpreter.define("answer", mal::integer(42));
+    interpreter.define("shout", [](const String& s) { return s + "!"; });
+    interpreter.define("twice", twice);
+    interpreter.define("negate",
+                       std::function<int(int)>([](int x) { return -x; }));
+    int calls = 0;
+    interpreter.define("count-call", [&calls]() { calls++; });
+    interpreter.define("first-arg", [](const String& name,
+                                       malValueIter argsBegin,
+                                       malValueIter argsEnd) {
+        checkArgsAtLeast(name.c_str(), 1, std::distance(argsBegin, argsEnd));
+        return *argsBegin;
+    });
+
+    CHECK(interpreter.eval("answer")->print(true) == "42");
+    CHECK(interpreter.eval("(shout \"hi\")")->print(true) == "\"hi!\"");
+    CHECK(interpreter.eval("(twice (negate 4))")->print(true) == "-8");
+    CHECK(interpreter.eval("(count-call)") == mal::nilValue());
+    CHECK(calls == 1);
+    CHECK(interpreter.eval("(first-arg :a :b)")->print(true) == ":a");
+    CHECK(interpreter.eval("(map twice [1 2])")->print(true) == "(2 4)");
+
+    CHECK(errorOf(interpreter, "(twice)") ==
+          "\"twice\" expects 1 arg, 0 supplied");
+    CHECK(errorOf(interpreter, "(shout 1)") == "1 is not a malString");
+    CHECK(errorOf(interpreter, "(first-arg)") ==
+          "\"first-arg\" expects at least 1 arg, 0 supplied");
+}
+
+static void testIntegerRanges()
+{
+    Interpreter interpreter;
+    interpreter.define("byte", [](int8_t x) { return x; });
+    interpreter.define("unsigned", [](unsigned x) { return x; });
+    interpreter.define("huge", []() { return (uint64_t)1 << 63; });
+
+    CHECK(interpreter.eval("(byte -128)")->print(true) == "-128");
+    CHECK(interpreter.eval("(byte 127)")->print(true) == "127");
+    CHECK(errorOf(interpreter, "(byte 128)") == "128 is out of range");
+    CHECK(errorOf(interpreter, "(byte -129)") == "-129 is out of range");
+    CHECK(interpreter.eval("(unsigned 4294967295)")->print(true) ==
+          "4294967295");
+    CHECK(errorOf(interpreter, "(unsigned -1)") == "-1 is out of range");
+    CHECK(errorOf(interpreter, "(unsigned 4294967296)") ==
+          "4294967296 is out of range");
+    CHECK(errorOf(interpreter, "(huge)") ==
+          "9223372036854775808 is too large for a mal integer");
+
+    bool isThrown = false;
+    try {
+        interpreter.call<uint8_t>("+", 200, 100);
+    }
+    catch (String& error) {
+        isThrown = (error == "300 is out of range");
+    }
+    CHECK(isThrown);
+}
+
+#ifdef MAL_THREADS
+// More threads than may use the interpreter at once, one after another.
+// Each is given the id of the one before, and takes over the counts of the
+// vector it left behind.
+static void testThreadExit()
+{
+    Interpreter interpreter;
+    const int64_t vectors = Counted<malVector>::live();
+    for (int i = 0; i < 70000; i++) {
+        std::thread([&interpreter, i]() {
+            interpreter.eval((i % 2 == 0) ? "(def! v [1 2])" : "(def! v nil)");
+        }).join();
+    }
+    CHECK(Counted<malVector>::live() == vectors);
+    CHECK(interpreter.eval("(+ 1 2)")->print(true) == "3");
+}
+#endif
+
+static String imagePath()
+{
+    return STRF("/tmp/mal-embedtest-%d.img", (int)getpid());
+}
+
+// Saves an image as save-image does, and loads it into a new interpreter
+// as --image does.
+static void testImageRoundTrip()
+{
+    const String path = imagePath();
+    {
+        Interpreter interpreter;
+        interpreter.eval("(defmacro! unless (fn* [c & body]"
+                         "  `(if ~c nil (do ~@body))))");
+        interpreter.eval("(def! make-counter (fn* []"
+                         "  (let* [n (atom 0)] (fn* [] (swap! n + 1)))))");
+        interpreter.eval("(def! counter (make-counter))");
+        interpreter.eval("(counter)");
+        interpreter.eval("(def! cycle (atom nil))");
+        interpreter.eval("(reset! cycle {:self cycle})");
+        interpreter.eval("(def! pair (fn* [x] {:x x \"y\" [x (unless x 0)]}))");
+        interpreter.eval("(def! tagged (with-meta [1 2] {:tag \"t\"}))");
+        Image::save(interpreter.env(), path);
+    }
+
+    Interpreter interpreter;
+    Image::load(interpreter.env(), path);
+    unlink(path.c_str());
+    CHECK(interpreter.eval("(unless false 7)")->print(true) == "7");
+    interpreter.eval("(def! check (fn* [x] (unless x :no)))");
+    CHECK(interpreter.eval("(check false)")->print(true) == ":no");
+    CHECK(interpreter.eval("(counter)")->print(true) == "2");
+    CHECK(interpreter.eval("((make-counter))")->print(true) == "1");
+    CHECK(interpreter.eval("(reset! (get @cycle :self) 5)")->print(true) ==
+          "5");
+    CHECK(interpreter.eval("@cycle")->print(true) == "5");
+    CHECK(interpreter.eval("(pair 1)")->print(true) ==
+          "{\"y\" [1 nil] :x 1}");
+    CHECK(interpreter.eval("(pair nil)")->print(true) ==
+          "{\"y\" [nil 0] :x nil}");
+    CHECK(interpreter.eval("(meta tagged)")->print(true) == "{:tag \"t\"}");
+    CHECK(interpreter.eval("(+ 1 2)")->print(true) == "3");
+}
+
+// The message of the error which loading an image made of bytes throws.
+static String loadError(const String& bytes)
+{
+    const String path = imagePath();
+    std::ofstream(path.c_str(), std::ios::binary) << bytes;
+    Interpreter interpreter;
+    String error;
+    try {
+        Image::load(interpreter.env(), path);
+    }
+    catch (String& e) {
+        error = e;
+    }
+    unlink(path.c_str());
+    return error;
+}
+
+// Images which are damaged, or made to misuse the loader, fail to load. The
+// tags are numbered as in Image.cpp.
+static void testInvalidImages()
+{
+    const String header("MALIMAGE\x01\x11", 10); // version 1, the root
+    const String invalid = imagePath() + " is not a valid image";
+    // An integer, 5, with no metadata, and its value set as an atom's.
+    CHECK(loadError(header + String("\x04\x0a\x00\x15\x02\x02\x16", 7))
+          == invalid);
+    // Transducers of a kind which doesn't exist, and a map with no function.
+    CHECK(loadError(header + String("\x10\x01\x09\x00\x00\x00\x16", 7))
+          == invalid);
+    CHECK(loadError(header + String("\x10\x01\x00\x00\x00\x00\x16", 7))
+          == invalid);
+    // A composition of no functions.
+    CHECK(loadError(header + String("\x0e\x00\x00\x16", 4)) == invalid);
+    CHECK(loadError(header + String("\x04", 1)) ==
+          imagePath() + " is truncated");
+    CHECK(loadError(header + String("\x16", 1)) == "");
+}
+
+int main(int argc, char* argv[])
+{
+    try {
+        testTeardown();
+        testForeignExceptions();
+        testScripts();
+        testDefine();
+        testIntegerRanges();
+#ifdef MAL_THREADS
+        testThreadExit();
+#endif
+        testImageRoundTrip();
+        testInvalidImages();
+    }
+    catch (String& error) {
+        std::cout << "FAILED with an error: " << error << "\n";
+        s_failures++;
+    }
+
+    if (s_failures != 0) {
+        std::cout << s_failures << " checks failed\n";
+        return 1;
+    }
+    std::cout << "All checks passed\n";
+    return 0;
+}
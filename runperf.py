@@ -0,0 +1,164 @@
+#!/usr/bin/env python3
+
+# Runs the perf tests against Mal implementations several times, and writes
+# the median wall time, peak RSS and, where the implementation reports it,
+# allocation count of each to stdout as JSON. Given a baseline written by an
+# earlier run, it exits nonzero if any of them has regressed by more than
+# the threshold.
+
+import argparse
+import json
+import os
+import re
+import statistics
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+PERF_FILES = ["perf1.mal", "perf2.mal", "perf3.mal"]
+
+# Implementations which print a JSON line of measurements to stderr when
+# given --bench-json.
+BENCH_JSON_IMPLS = set(["cpp"])
+
+RE_ITERS = re.compile(r'iters over \d+ seconds: (\d+)')
+
+# Metrics for which a bigger number is better. For all others, smaller is.
+HIGHER_IS_BETTER = set(["iters"])
+
+def eprint(*args, **kwargs):
+    print(*args, file=sys.stderr, **kwargs)
+
+parser = argparse.ArgumentParser(
+        description="Run the perf tests and check for regressions")
+parser.add_argument('impls', nargs="*", default=["cpp", "chris"],
+        help="implementations to run (default: cpp chris)")
+parser.add_argument('--runs', default=3, type=int,
+        help="number of times to run each perf test")
+parser.add_argument('--baseline', type=str,
+        help="results of an earlier run to compare against")
+parser.add_argument('--threshold', default=10.0, type=float,
+        help="percentage change from the baseline which counts as a "
+             "regression")
+parser.add_argument('--output', type=str,
+        help="write the results to the named file as well as stdout")
+parser.add_argument('--timeout', default=120, type=int,
+        help="timeout for each run, in seconds")
+
+def run_once(impl_dir, impl, perf_file, timeout):
+    cmd = ["../%s/run" % impl]
+    if impl in BENCH_JSON_IMPLS:
+        cmd.append("--bench-json")
+    cmd.append("../tests/%s" % perf_file)
+
+    # Waiting with wait4 rather than through Popen gives the peak RSS of the
+    # process, as the run scripts exec the implementation.
+    with tempfile.TemporaryFile("w+") as out, \
+         tempfile.TemporaryFile("w+") as err:
+        start = time.monotonic()
+        proc = subprocess.Popen(cmd, cwd=impl_dir, stdout=out, stderr=err)
+        timer = threading.Timer(timeout, proc.kill)
+        timer.start()
+        _, status, usage = os.wait4(proc.pid, 0)
+        wall_ms = (time.monotonic() - start) * 1000
+        timed_out = timer.finished.is_set()
+        timer.cancel()
+        proc.returncode = status
+        out.seek(0)
+        err.seek(0)
+        out, err = out.read(), err.read()
+
+    if timed_out:
+        raise Exception("%s timed out after %d seconds" % (perf_file, timeout))
+    if status != 0:
+        raise Exception("%s failed: %s" % (perf_file, err.strip()))
+
+    # ru_maxrss is in kilobytes on Linux, but bytes on Mac OS X.
+    peak_rss_kb = usage.ru_maxrss
+    if sys.platform == "darwin":
+        peak_rss_kb //= 1024
+    result = {"wall_ms": wall_ms, "peak_rss_kb": peak_rss_kb}
+    match = RE_ITERS.search(out)
+    if match:
+        result["iters"] = int(match.group(1))
+    for line in reversed(err.splitlines()):
+        if line.startswith("{"):
+            result["allocations"] = json.loads(line)["allocations"]
+            break
+
+    # Tests which count iterations in a fixed time are measured by the count,
+    # so their allocations are only comparable per iteration. The count
+    # includes the warmup's allocations, but not its iterations.
+    if "iters" in result:
+        del result["wall_ms"]
+        if "allocations" in result:
+            result["allocations_per_iter"] = round(
+                result.pop("allocations") / max(1, result["iters"]), 2)
+    return result
+
+def run_impl(impl, args):
+    impl_dir = os.path.join("impls", impl)
+    if not os.path.exists(os.path.join(impl_dir, "stepA_mal")):
+        eprint("%s: no stepA_mal, skipping (build it with make first)" % impl)
+        return None
+
+    results = {}
+    for perf_file in PERF_FILES:
+        runs = [run_once(impl_dir, impl, perf_file, args.timeout)
+                for _ in range(args.runs)]
+        results[perf_file] = dict(
+            (metric, statistics.median(run[metric] for run in runs))
+            for metric in runs[0])
+        eprint("%s %s: %s" % (impl, perf_file, results[perf_file]))
+    return results
+
+def regressions(results, baseline, threshold):
+    found = []
+    for impl, files in baseline.items():
+        for perf_file, metrics in (files or {}).items():
+            current = ((results.get(impl) or {}).get(perf_file)) or {}
+            for metric, base in metrics.items():
+                if metric not in current or base == 0:
+                    continue
+                change = (current[metric] - base) * 100.0 / base
+                if metric in HIGHER_IS_BETTER:
+                    change = -change
+                if change > threshold:
+                    found.append("%s %s %s: %s -> %s (%.1f%% worse)" %
+                                 (impl, perf_file, metric, base,
+                                  current[metric], change))
+    return found
+
+def main():
+    args = parser.parse_args()
+    os.chdir(os.path.dirname(os.path.abspath(__file__)))
+
+    results = {}
+    try:
+        for impl in args.impls:
+            results[impl] = run_impl(impl, args)
+    except Exception as e:
+        eprint("Error: %s" % e)
+        return 2
+
+    text = json.dumps(results, indent=2, sort_keys=True)
+    print(text)
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(text + "\n")
+
+    if args.baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+        found = regressions(results, baseline, args.threshold)
+        for regression in found:
+            eprint("REGRESSION: %s" % regression)
+        if found:
+            return 1
+        eprint("No regressions over %.1f%%" % args.threshold)
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main())